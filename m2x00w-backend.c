@@ -0,0 +1,321 @@
+/* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers - usblp backend */
+/* Copyright (c) 2014 Ondrej Zary */
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/lp.h>
+
+#define ERR(fmt, args ...)	fprintf(stderr, "ERROR: M2X00W " fmt "\n", ##args);
+#define WARN(fmt, args ...)	fprintf(stderr, "WARNING: M2X00W " fmt "\n", ##args);
+#define DBG(fmt, args ...)	fprintf(stderr, "DEBUG: M2X00W " fmt "\n", ##args);
+#define INFO(fmt, args ...)	fprintf(stderr, "INFO: " fmt "\n", ##args);
+#define STATE(fmt, args ...)	fprintf(stderr, "STATE: " fmt "\n", ##args);
+
+/* exit codes from cups/backend.h */
+enum backend_status { BACKEND_OK = 0, BACKEND_FAILED = 1, BACKEND_STOP = 4, BACKEND_RETRY = 6 };
+
+/* usblp ioctl to read the IEEE 1284 device ID */
+#define IOCNR_GET_DEVICE_ID	1
+#define LPIOC_GET_DEVICE_ID(len)	_IOC(_IOC_READ, 'P', IOCNR_GET_DEVICE_ID, len)
+
+#define DEFAULT_CHUNK		(256 * 1024)	/* bytes per write() */
+#define DEFAULT_STALL		10		/* seconds without progress before reporting */
+#define PROGRESS_INTERVAL	2		/* seconds between progress messages */
+#define OPEN_TIMEOUT		60		/* seconds to wait for a missing device node */
+
+struct device {
+	const char *path;
+	int fd;
+	int chunk;		/* write size */
+	int stall;		/* stall timeout in seconds */
+	bool stalled;
+	unsigned long sent;
+	time_t last_progress;
+};
+
+/* parse "m2x00w:/dev/usb/lp0?chunk=65536&stall=30" */
+int parse_uri(char *uri, struct device *dev) {
+	char *opts, *opt, *save;
+
+	if (strncmp(uri, "m2x00w:", 7))
+		return -1;
+	dev->path = uri + 7;
+	while (!strncmp(dev->path, "//", 2))
+		dev->path++;
+	opts = strchr(dev->path, '?');
+	if (!opts)
+		return 0;
+	*opts++ = '\0';
+	for (opt = strtok_r(opts, "&", &save); opt; opt = strtok_r(NULL, "&", &save)) {
+		if (!strncmp(opt, "chunk=", 6))
+			dev->chunk = atoi(opt + 6);
+		else if (!strncmp(opt, "stall=", 6))
+			dev->stall = atoi(opt + 6);
+		else
+			WARN("Unknown URI option %s", opt);
+	}
+	if (dev->chunk < 512)
+		dev->chunk = 512;
+	if (dev->stall < 1)
+		dev->stall = 1;
+
+	return 0;
+}
+
+/* print usblp devices of supported printers for lpinfo */
+void list_devices(void) {
+	glob_t g;
+
+	printf("direct m2x00w \"Unknown\" \"Minolta magicolor 2x00W (usblp)\"\n");
+	if (glob("/dev/usb/lp*", 0, NULL, &g))
+		return;
+	for (size_t i = 0; i < g.gl_pathc; i++) {
+		char id[1024], *mfg, *mdl;
+		int fd = open(g.gl_pathv[i], O_RDONLY | O_NONBLOCK);
+		int len;
+
+		if (fd < 0)
+			continue;
+		memset(id, 0, sizeof(id));
+		len = ioctl(fd, LPIOC_GET_DEVICE_ID(sizeof(id) - 1), id);
+		close(fd);
+		if (len < 0)
+			continue;
+		/* first two bytes are big endian length */
+		len = ((unsigned char)id[0] << 8) | (unsigned char)id[1];
+		if (len < 2 || len > (int)sizeof(id) - 1)
+			continue;
+		memmove(id, id + 2, len - 2);
+		id[len - 2] = '\0';
+		if (!strstr(id, "2300W") && !strstr(id, "2400W") && !strstr(id, "2500W"))
+			continue;
+		mfg = strstr(id, "MFG:");
+		mdl = strstr(id, "MDL:");
+		if (!mfg || !mdl)
+			continue;
+		printf("direct m2x00w:%s \"%.*s %.*s\" \"%.*s %.*s (usblp)\" \"%s\" \"\"\n", g.gl_pathv[i],
+			(int)strcspn(mfg + 4, ";"), mfg + 4, (int)strcspn(mdl + 4, ";"), mdl + 4,
+			(int)strcspn(mfg + 4, ";"), mfg + 4, (int)strcspn(mdl + 4, ";"), mdl + 4, id);
+	}
+	globfree(&g);
+}
+
+/* wait for the device node to appear and accept writes, give up on a missing node after OPEN_TIMEOUT */
+int open_device(struct device *dev) {
+	time_t start = time(NULL);
+	bool reported = false;
+
+	for (;;) {
+		dev->fd = open(dev->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+		if (dev->fd >= 0)
+			break;
+		/* ENXIO: FIFO without reader or printer switched off */
+		if (errno != ENOENT && errno != ENODEV && errno != ENXIO && errno != EBUSY) {
+			ERR("Unable to open %s: %s", dev->path, strerror(errno));
+			return -1;
+		}
+		/* printer unplugged for long or a mistyped path, let CUPS retry the job later */
+		if (errno == ENOENT && time(NULL) - start >= OPEN_TIMEOUT) {
+			ERR("%s not found", dev->path);
+			if (reported)
+				STATE("-connecting-to-device");
+			return -1;
+		}
+		if (!reported) {
+			INFO("Waiting for printer to become available");
+			STATE("+connecting-to-device");
+			reported = true;
+		}
+		sleep(1);
+	}
+	if (reported)
+		STATE("-connecting-to-device");
+
+	return 0;
+}
+
+/* translate usblp status into printer-state-reasons while stalled */
+void report_status(struct device *dev) {
+	int status;
+
+	if (ioctl(dev->fd, LPGETSTATUS, &status))
+		return;	/* not usblp, e.g. FIFO used for testing */
+	DBG("usblp status 0x%02x", status);
+	if (status & LP_POUTPA)
+		STATE("+media-empty-error");
+	if (!(status & LP_PSELECD))
+		STATE("+offline-report");
+	if (!(status & LP_PERRORP))
+		STATE("+other-error");
+}
+
+void clear_status(void) {
+	STATE("-media-empty-error,offline-report,other-error,timed-out");
+}
+
+void report_progress(struct device *dev, bool force) {
+	time_t now = time(NULL);
+
+	if (!force && now - dev->last_progress < PROGRESS_INTERVAL)
+		return;
+	INFO("Sent %lu kB", dev->sent / 1024);
+	dev->last_progress = now;
+}
+
+int write_all(struct device *dev, const char *buf, size_t len) {
+	while (len > 0) {
+		struct pollfd pfd = { .fd = dev->fd, .events = POLLOUT };
+		int ret = poll(&pfd, 1, dev->stall * 1000);
+		ssize_t written;
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ERR("poll: %s", strerror(errno));
+			return -1;
+		}
+		if (ret == 0) {
+			if (!dev->stalled) {
+				WARN("Printer not accepting data for %d seconds", dev->stall);
+				INFO("Printer not responding, waiting");
+				STATE("+timed-out");
+				dev->stalled = true;
+			}
+			report_status(dev);
+			continue;
+		}
+		if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			ERR("Printer disconnected");
+			return -1;
+		}
+		written = write(dev->fd, buf, len);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+			ERR("Write error: %s", strerror(errno));
+			return -1;
+		}
+		if (dev->stalled) {
+			INFO("Printer accepting data again");
+			clear_status();
+			dev->stalled = false;
+		}
+		buf += written;
+		len -= written;
+		dev->sent += written;
+		report_progress(dev, false);
+	}
+
+	return 0;
+}
+
+/* read until the buffer is full so that the device gets large writes */
+ssize_t read_full(int fd, char *buf, size_t len) {
+	size_t pos = 0;
+
+	while (pos < len) {
+		ssize_t ret = read(fd, buf + pos, len - pos);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		pos += ret;
+	}
+
+	return pos;
+}
+
+int send_file(struct device *dev, int fd, char *buf) {
+	ssize_t len;
+
+	while ((len = read_full(fd, buf, dev->chunk)) > 0)
+		if (write_all(dev, buf, len))
+			return -1;
+	if (len < 0) {
+		ERR("Unable to read print data: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct device dev = { .chunk = DEFAULT_CHUNK, .stall = DEFAULT_STALL };
+	int fd = 0, copies = 1, ret = BACKEND_OK;
+	char *uri, *buf;
+
+	if (argc == 1) {
+		list_devices();
+		return BACKEND_OK;
+	}
+	if (argc < 6 || argc > 7) {
+		fprintf(stderr, "usage: m2x00w job-id user title copies options [file]\n");
+		return BACKEND_FAILED;
+	}
+
+	uri = getenv("DEVICE_URI");
+	if (!uri || parse_uri(uri = strdup(uri), &dev)) {
+		ERR("Invalid device URI %s, expected m2x00w:/dev/usb/lpN", uri ? uri : "(none)");
+		return BACKEND_STOP;
+	}
+	DBG("device=%s chunk=%d stall=%d", dev.path, dev.chunk, dev.stall);
+
+	if (argc > 6) {
+		fd = open(argv[6], O_RDONLY);
+		if (fd == -1) {
+			ERR("Unable to open print file %s: %s", argv[6], strerror(errno));
+			return BACKEND_FAILED;
+		}
+		copies = atoi(argv[4]);
+		if (copies < 1)
+			copies = 1;
+	} else
+		/* finish the job that filters already produced when cancelled */
+		signal(SIGTERM, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	buf = malloc(dev.chunk);
+	if (!buf) {
+		ERR("Memory allocation error");
+		return BACKEND_FAILED;
+	}
+	if (open_device(&dev)) {
+		free(buf);
+		return BACKEND_RETRY;
+	}
+	INFO("Sending data to printer");
+
+	for (int i = 0; i < copies; i++) {
+		if (i > 0)
+			lseek(fd, 0, SEEK_SET);
+		if (send_file(&dev, fd, buf)) {
+			ret = BACKEND_RETRY;
+			break;
+		}
+	}
+	if (ret == BACKEND_OK) {
+		report_progress(&dev, true);
+		INFO("Ready to print");
+	}
+
+	close(dev.fd);
+	if (fd)
+		close(fd);
+	free(buf);
+	free(uri);
+	return ret;
+}
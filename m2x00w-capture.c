@@ -0,0 +1,318 @@
+/* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers - output capture */
+/* Copyright (c) 2014 Ondrej Zary */
+#define _DEFAULT_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "m2x00w.h"
+
+/*
+ * Output capture:
+ * Data written to the printer are also copied into a ring buffer and a writer thread
+ * saves them into <dir>/m2x00w-<date>-<time>-<pid>-<job>.prn, together with an index of
+ * block offsets (.idx). The printing thread only does a memcpy and never waits for the writer.
+ * The ring grows to hold writes larger than itself (huge bands). A write that does not fit
+ * into the free space means the writer can't keep up, so the capture is abandoned.
+ * When the capture is finished, the oldest captures are removed to keep the directory
+ * under the size limit.
+ */
+
+#define CAPTURE_RING_SIZE	(4 * 1024 * 1024)
+#define CAPTURE_PREFIX		"m2x00w-"
+
+struct m2x00w_capture {
+	m2x00w_sink_t sink;
+	void *sink_priv;
+	char *dir;
+	u64 max_bytes;
+	/* ring buffer shared with the writer thread */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	u8 *ring;
+	size_t ring_size;
+	u8 *old_ring;		/* replaced by a bigger ring, freed by the writer after its write */
+	u64 head;		/* total bytes put into the ring */
+	u64 tail;		/* total bytes written out by the writer thread */
+	bool finishing;
+	bool overflow;
+	/* writer thread only */
+	FILE *prn;
+	FILE *idx;
+	u64 offset;		/* stream offset of the next byte */
+	u8 block[sizeof(struct header) + sizeof(struct block_data)];
+	int block_len;		/* bytes of the current block collected in block[] */
+	int block_want;		/* bytes of the block to collect */
+	u64 skip;		/* bytes of the current block not needed for the index */
+	u64 block_offset;
+};
+
+static const char *block_name(u8 type) {
+	switch (type) {
+	case M2X00W_BLOCK_BEGIN:	return "BEGIN";
+	case M2X00W_BLOCK_PARAMS:	return "PARAMS";
+	case M2X00W_BLOCK_PAGE:		return "PAGE";
+	case M2X00W_BLOCK_DATA:		return "DATA";
+	case M2X00W_BLOCK_ENDPART:	return "ENDPART";
+	case M2X00W_BLOCK_END:		return "END";
+	default:			return "UNKNOWN";
+	}
+}
+
+static void index_block(struct m2x00w_capture *cap) {
+	struct header *header = (struct header *)cap->block;
+	int len = le16_to_cpu(header->len);
+
+	fprintf(cap->idx, "%llu %s seq=%d len=%d", (unsigned long long)cap->block_offset,
+		block_name(header->type), header->seq, len);
+	/* skip the rest of the block, checksum and raster data */
+	cap->skip = len + 1 - (cap->block_len - sizeof(struct header));
+	if (header->type == M2X00W_BLOCK_DATA && len >= (int)sizeof(struct block_data)) {
+		struct block_data *data = (struct block_data *)header->data;
+
+		fprintf(cap->idx, " color=%d block=%d lines=%d data_len=%u", data->color,
+			data->block_num, le16_to_cpu(data->lines), le32_to_cpu(data->data_len));
+		cap->skip += le32_to_cpu(data->data_len);
+	}
+	fprintf(cap->idx, "\n");
+}
+
+/* find block boundaries in data going to the capture file */
+static void index_data(struct m2x00w_capture *cap, const u8 *data, size_t len) {
+	while (len > 0) {
+		size_t chunk;
+
+		if (cap->skip) {
+			chunk = (cap->skip < len) ? cap->skip : len;
+			cap->skip -= chunk;
+		} else {
+			if (cap->block_len == 0) {
+				cap->block_offset = cap->offset;
+				cap->block_want = sizeof(struct header);
+			}
+			chunk = cap->block_want - cap->block_len;
+			if (chunk > len)
+				chunk = len;
+			memcpy(cap->block + cap->block_len, data, chunk);
+			cap->block_len += chunk;
+			if (cap->block_len == cap->block_want) {
+				struct header *header = (struct header *)cap->block;
+
+				if (cap->block_want == sizeof(struct header) && header->type == M2X00W_BLOCK_DATA &&
+				    le16_to_cpu(header->len) >= sizeof(struct block_data))
+					/* need the data block header for raster data length */
+					cap->block_want += sizeof(struct block_data);
+				else {
+					index_block(cap);
+					cap->block_len = 0;
+				}
+			}
+		}
+		cap->offset += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+static void *writer_thread(void *arg) {
+	struct m2x00w_capture *cap = arg;
+
+	pthread_mutex_lock(&cap->lock);
+	for (;;) {
+		while (cap->tail == cap->head && !cap->finishing && !cap->overflow)
+			pthread_cond_wait(&cap->cond, &cap->lock);
+		if (cap->overflow || cap->tail == cap->head)
+			break;
+		/* write out contiguous part of the ring without holding the lock */
+		u8 *ring = cap->ring;
+		size_t pos = cap->tail % cap->ring_size;
+		size_t len = cap->head - cap->tail;
+		if (len > cap->ring_size - pos)
+			len = cap->ring_size - pos;
+		pthread_mutex_unlock(&cap->lock);
+
+		fwrite(ring + pos, 1, len, cap->prn);
+		index_data(cap, ring + pos, len);
+
+		pthread_mutex_lock(&cap->lock);
+		cap->tail += len;
+		free(cap->old_ring);
+		cap->old_ring = NULL;
+		pthread_cond_broadcast(&cap->cond);
+	}
+	if (cap->overflow)
+		fprintf(cap->idx, "# incomplete: capture could not keep up with printing\n");
+	pthread_mutex_unlock(&cap->lock);
+
+	return NULL;
+}
+
+/* copy data into the ring at stream position 'at', wrapping around the end */
+static void ring_put(u8 *ring, size_t size, u64 at, const u8 *data, size_t len) {
+	size_t pos = at % size;
+	size_t chunk = (len < size - pos) ? len : size - pos;
+
+	memcpy(ring + pos, data, chunk);
+	memcpy(ring, data + chunk, len - chunk);
+}
+
+/*
+ * Move unwritten data into a ring big enough for a write of len bytes. The writer may be
+ * writing from the current ring without the lock, so that one is freed by the writer.
+ */
+static int grow_ring(struct m2x00w_capture *cap, size_t len) {
+	size_t size = len + CAPTURE_RING_SIZE;
+	u8 *ring = malloc(size);
+	u64 at = cap->tail;
+
+	if (!ring)
+		return -1;
+	while (at < cap->head) {
+		size_t pos = at % cap->ring_size;
+		size_t chunk = cap->head - at;
+
+		if (chunk > cap->ring_size - pos)
+			chunk = cap->ring_size - pos;
+
+		ring_put(ring, size, at, cap->ring + pos, chunk);
+		at += chunk;
+	}
+	/* a ring that replaced the one being written out is not used by the writer */
+	if (cap->old_ring)
+		free(cap->ring);
+	else
+		cap->old_ring = cap->ring;
+	cap->ring = ring;
+	cap->ring_size = size;
+
+	return 0;
+}
+
+int m2x00w_capture_sink(void *priv, const void *data, size_t len) {
+	struct m2x00w_capture *cap = priv;
+	int ret = cap->sink(cap->sink_priv, data, len);
+
+	pthread_mutex_lock(&cap->lock);
+	if (!cap->overflow && len > cap->ring_size && grow_ring(cap, len))
+		cap->overflow = true;
+	if (!cap->overflow && cap->head - cap->tail + len > cap->ring_size)
+		cap->overflow = true;
+	if (!cap->overflow) {
+		ring_put(cap->ring, cap->ring_size, cap->head, data, len);
+		cap->head += len;
+	}
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+
+	return ret;
+}
+
+struct m2x00w_capture *m2x00w_capture_start(const char *dir, const char *job, u64 max_bytes, m2x00w_sink_t sink, void *priv) {
+	struct m2x00w_capture *cap = calloc(1, sizeof(*cap));
+	char stamp[32], *name;
+	struct timespec now;
+	struct tm tm;
+	size_t len;
+
+	if (!cap)
+		return NULL;
+	cap->sink = sink;
+	cap->sink_priv = priv;
+	cap->max_bytes = max_bytes;
+	cap->dir = strdup(dir);
+	cap->ring = malloc(CAPTURE_RING_SIZE);
+	cap->ring_size = CAPTURE_RING_SIZE;
+	/* microseconds keep names of captures in the same second in order */
+	clock_gettime(CLOCK_REALTIME, &now);
+	len = strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now.tv_sec, &tm));
+	snprintf(stamp + len, sizeof(stamp) - len, ".%06ld", now.tv_nsec / 1000);
+	len = strlen(dir) + strlen(CAPTURE_PREFIX) + strlen(stamp) + strlen(job) + 32;
+	name = malloc(len);
+	if (!cap->dir || !cap->ring || !name)
+		goto err;
+	int n = snprintf(name, len, "%s/" CAPTURE_PREFIX "%s-%d-", dir, stamp, (int)getpid());
+	/* job id or file name in batch mode */
+	for (const char *p = job; *p; p++)
+		name[n++] = (isalnum((unsigned char)*p) || *p == '-') ? *p : '_';
+	strcpy(name + n, ".prn");
+	cap->prn = fopen(name, "w");
+	strcpy(name + n, ".idx");
+	cap->idx = fopen(name, "w");
+	free(name);
+	name = NULL;
+	if (!cap->prn || !cap->idx)
+		goto err;
+	fprintf(cap->idx, "# offset block seq len [color block lines data_len]\n");
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+	if (pthread_create(&cap->thread, NULL, writer_thread, cap)) {
+		pthread_mutex_destroy(&cap->lock);
+		pthread_cond_destroy(&cap->cond);
+		goto err;
+	}
+
+	return cap;
+err:
+	if (cap->prn)
+		fclose(cap->prn);
+	if (cap->idx)
+		fclose(cap->idx);
+	free(name);
+	free(cap->ring);
+	free(cap->dir);
+	free(cap);
+	return NULL;
+}
+
+static int capture_filter(const struct dirent *d) {
+	return !strncmp(d->d_name, CAPTURE_PREFIX, strlen(CAPTURE_PREFIX));
+}
+
+/* remove oldest captures (names start with date and time) over the size limit */
+static void prune(const char *dir, u64 max_bytes) {
+	struct dirent **list;
+	int n = scandir(dir, &list, capture_filter, alphasort);
+	u64 total = 0;
+	char path[4096];
+
+	if (n < 0)
+		return;
+	for (int i = n - 1; i >= 0; i--) {
+		struct stat st;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, list[i]->d_name);
+		if (!stat(path, &st))
+			total += st.st_size;
+		/* keep the newest files under the limit, remove everything older */
+		if (total > max_bytes)
+			unlink(path);
+		free(list[i]);
+	}
+	free(list);
+}
+
+void m2x00w_capture_finish(struct m2x00w_capture *cap) {
+	if (!cap)
+		return;
+	pthread_mutex_lock(&cap->lock);
+	cap->finishing = true;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->thread, NULL);
+
+	fclose(cap->prn);
+	fclose(cap->idx);
+	prune(cap->dir, cap->max_bytes);
+	pthread_mutex_destroy(&cap->lock);
+	pthread_cond_destroy(&cap->cond);
+	free(cap->old_ring);
+	free(cap->ring);
+	free(cap->dir);
+	free(cap);
+}
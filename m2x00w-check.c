@@ -0,0 +1,281 @@
+/* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers - encoder/decoder round trip test */
+/* Copyright (c) 2014 Ondrej Zary */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "m2x00w.h"
+
+/*
+ * Synthetic pages are encoded for each model with various band counts, heights and color
+ * contents, then decoded again. The decoded bitmap must match the input, the stream must
+ * decode without errors and the page must announce the right number of data blocks.
+ * The paper table must be sorted, or bsearch() silently misses names.
+ */
+
+struct membuf {
+	u8 *data;
+	size_t len;
+	size_t size;
+};
+
+struct result {
+	struct membuf raster;
+	int errors;
+	int pages;
+	int blocks1;
+	int data_blocks;
+	bool color;
+};
+
+static u32 rnd_state;
+
+u32 rnd(void) {
+	/* xorshift32, fixed seed keeps the test reproducible */
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+
+	return rnd_state;
+}
+
+int membuf_add(struct membuf *buf, const void *data, size_t len) {
+	if (buf->len + len > buf->size) {
+		size_t size = 2 * (buf->len + len);
+		u8 *p = realloc(buf->data, size);
+
+		if (!p)
+			return -1;
+		buf->data = p;
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+
+	return 0;
+}
+
+int mem_sink(void *priv, const void *data, size_t len) {
+	return membuf_add(priv, data, len);
+}
+
+void check_error(void *priv, enum m2x00w_decode_error err, long offset, const char *msg) {
+	struct result *res = priv;
+
+	fprintf(stderr, "  decode error %s at %ld: %s\n", m2x00w_decode_error_name(err), offset, msg);
+	res->errors++;
+}
+
+void check_block(void *priv, const struct header *header, const void *data, long offset) {
+	struct result *res = priv;
+	(void)data; (void)offset;
+
+	if (header->type == M2X00W_BLOCK_DATA)
+		res->data_blocks++;
+}
+
+void check_page(void *priv, const struct block_page *page) {
+	struct result *res = priv;
+
+	res->pages++;
+	res->blocks1 = le16_to_cpu(page->blocks1);
+	res->color = (page->color_mode == MODE_COLOR);
+}
+
+void check_raster(void *priv, const u8 *data, int len) {
+	struct result *res = priv;
+
+	membuf_add(&res->raster, data, len);
+}
+
+/* a line of runs, random bytes and empty parts like dithered output */
+void fill_line(u8 *line, int len) {
+	int pos = 0;
+
+	while (pos < len) {
+		int count = 1 + rnd() % 300;
+
+		if (count > len - pos)
+			count = len - pos;
+		switch (rnd() % 4) {
+		case 0:
+			memset(line + pos, 0, count);
+			break;
+		case 1:
+			memset(line + pos, rnd(), count);
+			break;
+		default:
+			for (int i = 0; i < count; i++)
+				line[pos + i] = rnd();
+		}
+		pos += count;
+	}
+}
+
+/*
+ * color: 0 = K only, 1 = all planes, 2 = color page with empty Y, M and C (sent as BW),
+ * 3 = color starts in the middle of the C plane (lazy color mode)
+ */
+u8 *make_page(int line_len, int height, int color) {
+	int planes = color ? 4 : 1;
+	u8 *page = calloc(planes * height, line_len);
+
+	if (!page)
+		return NULL;
+	for (int plane = 0; plane < planes; plane++)
+		for (int y = 0; y < height; y++) {
+			u8 *line = page + ((size_t)plane * height + y) * line_len;
+
+			if (rnd() % 4 == 0)
+				continue;
+			if (planes == 4 && plane < 3 && color == 2)
+				continue;
+			if (planes == 4 && color == 3 && (plane < 2 || (plane == 2 && y < height / 2)))
+				continue;
+			fill_line(line, line_len);
+		}
+
+	return page;
+}
+
+int run_test(enum m2x00w_model model, int width, int height, int bands, int color) {
+	static const struct m2x00w_decoder_ops ops = {
+		.error = check_error,
+		.block = check_block,
+		.page = check_page,
+		.raster = check_raster,
+	};
+	int line_len = DIV_ROUND_UP(width, 8);
+	struct m2x00w_page_info info = {
+		.width = width,
+		.height = height,
+		.line_len = line_len,
+		.dpi = 600,
+		.color = color != 0,
+		.copies = 1,
+		.paper_size = PAPER_A4,
+		.bands = bands,
+	};
+	struct membuf out = { 0 };
+	struct result res = { 0 };
+	struct m2x00w_encoder *enc = m2x00w_encoder_new(model, mem_sink, &out);
+	struct m2x00w_decoder *dec = m2x00w_decoder_new(&ops, &res);
+	u8 *page = make_page(line_len, height, color);
+	int planes = 1;
+	int out_height = (model == M2400W) ? ROUND_UP_MULTIPLE(height, 2) : height;
+	int lines_per_block = DIV_ROUND_UP(height, bands);
+	int failed = 0;
+
+	if (!enc || !dec || !page) {
+		fprintf(stderr, "Memory allocation error\n");
+		exit(2);
+	}
+	if (model == M2400W)
+		lines_per_block = ROUND_UP_MULTIPLE(lines_per_block, 2);
+	/* pages with empty Y, M and C are printed as BW */
+	for (size_t i = 0; color && i < (size_t)3 * height * line_len; i++)
+		if (page[i]) {
+			planes = 4;
+			break;
+		}
+
+	if (m2x00w_encoder_begin_job(enc) ||
+	    m2x00w_encoder_begin_page(enc, &info) ||
+	    m2x00w_encoder_push_lines(enc, page, (color ? 4 : 1) * height) ||
+	    m2x00w_encoder_end_page(enc) ||
+	    m2x00w_encoder_end_job(enc)) {
+		fprintf(stderr, "  encoder error: %s\n", m2x00w_encoder_error(enc));
+		failed = 1;
+		goto out;
+	}
+	if (m2x00w_decoder_push(dec, out.data, out.len) || m2x00w_decoder_finish(dec) || res.errors) {
+		fprintf(stderr, "  stream does not decode cleanly\n");
+		failed = 1;
+	}
+	if (res.pages != 1 || res.color != (planes == 4)) {
+		fprintf(stderr, "  %d pages, color %d\n", res.pages, res.color);
+		failed = 1;
+		goto out;
+	}
+	if (res.blocks1 != DIV_ROUND_UP(height, lines_per_block) * planes || res.data_blocks != res.blocks1) {
+		fprintf(stderr, "  blocks1 %d, %d data blocks, expected %d\n", res.blocks1, res.data_blocks,
+			DIV_ROUND_UP(height, lines_per_block) * planes);
+		failed = 1;
+	}
+	/* planes come out in the order they are sent: Y, M, C, K, or K only */
+	if (res.raster.len != (size_t)planes * out_height * line_len) {
+		fprintf(stderr, "  decoded %zu bytes, expected %zu\n", res.raster.len, (size_t)planes * out_height * line_len);
+		failed = 1;
+		goto out;
+	}
+	for (int plane = 0; plane < planes; plane++) {
+		const u8 *in = page + (size_t)(planes == 4 ? plane : (color ? 3 : 0)) * height * line_len;
+		const u8 *dec_plane = res.raster.data + (size_t)plane * out_height * line_len;
+
+		if (memcmp(in, dec_plane, (size_t)height * line_len)) {
+			fprintf(stderr, "  plane %d differs\n", plane);
+			failed = 1;
+		}
+		/* 2400W pads odd height with an empty line */
+		for (int i = height * line_len; i < out_height * line_len; i++)
+			if (dec_plane[i]) {
+				fprintf(stderr, "  plane %d padding line not empty\n", plane);
+				failed = 1;
+				break;
+			}
+	}
+out:
+	m2x00w_encoder_free(enc);
+	m2x00w_decoder_free(dec);
+	free(res.raster.data);
+	free(out.data);
+	free(page);
+	return failed;
+}
+
+int check_papers(void) {
+	int failed = 0;
+
+	for (size_t i = 0; i < m2x00w_num_papers; i++) {
+		const struct m2x00w_paper *paper = &m2x00w_papers[i];
+
+		if (i > 0 && strcmp(m2x00w_papers[i - 1].name, paper->name) >= 0) {
+			fprintf(stderr, "FAIL: paper table not sorted at %s\n", paper->name);
+			failed++;
+		}
+		if (m2x00w_paper_size(paper->name) != paper->code) {
+			fprintf(stderr, "FAIL: paper %s not found\n", paper->name);
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+int main(void) {
+	static const enum m2x00w_model models[] = { M2300W, M2400W, M2500W };
+	static const char *model_names[] = { "2300W", "2400W", "2500W" };
+	static const int bands[] = { 1, 4, 8, 16, 32, 64, MAX_BLOCKS_PER_PAGE };
+	static const int heights[] = { 1, 2, 7, 100, 101, 257, 1001 };
+	static const int widths[] = { 8, 203, 1200 };
+	int tests = 0, failures = 0;
+
+	rnd_state = 0x2400;
+	for (unsigned int m = 0; m < ARRAY_SIZE(models); m++)
+		for (unsigned int b = 0; b < ARRAY_SIZE(bands); b++)
+			for (unsigned int h = 0; h < ARRAY_SIZE(heights); h++)
+				for (int color = 0; color < 4; color++) {
+					int width = widths[(b + h + color) % ARRAY_SIZE(widths)];
+
+					tests++;
+					if (run_test(models[m], width, heights[h], bands[b], color)) {
+						fprintf(stderr, "FAIL: %s width %d height %d bands %d color %d\n",
+							model_names[m], width, heights[h], bands[b], color);
+						failures++;
+					}
+				}
+	tests += m2x00w_num_papers;
+	failures += check_papers();
+	printf("%d tests, %d failed\n", tests, failures);
+
+	return failures ? 1 : 0;
+}
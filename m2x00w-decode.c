@@ -1,285 +1,146 @@
 /* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers - decoder */
 /* Copyright (c) 2014 Ondrej Zary */
 /* Based on min_decode by Orion Sky Lawlor, olawlor@acm.org */
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "m2x00w.h"
 
-enum m2x00w_model model;
-int line_bytes;
-u8 *line_buf;
-int buf_pos;
-
-char *decode_model(u8 model) {
-	switch (model) {
-	case 0x81: return "1200W/1250W";
-	case 0x82: return "2300W";
-	case 0x83: return "1300W/1350W";
-	case 0x85: return "2400W";
-	case 0x87: return "2500W";
-	default:   return "unknown";
-	}
+void print_trace(void *priv, const char *fmt, va_list ap) {
+	(void)priv;
+	vprintf(fmt, ap);
 }
 
-char *decode_media_type(u8 media) {
-	static char *media_types[] = { "Plain", "Thick", "Transparency", "Envelope", "Letterhead",
-				    "Postcard", "Label", "unknown", "GLOSSY/Glossy" };
-	if (media < ARRAY_SIZE(media_types))
-		return media_types[media];
-	return "unknown";
+void print_error(void *priv, enum m2x00w_decode_error err, long offset, const char *msg) {
+	(void)priv; (void)err; (void)offset;
+	fprintf(stderr, "%s\n", msg);
 }
 
-char *decode_paper_size(u8 paper) {
-	switch (paper) {
-	case 0x04: return "A4";
-	case 0x06: return "B5 (JIS)";
-	case 0x08: return "A5";
-	case 0x0C: return "J postcard";
-	case 0x0D: return "double postcard";
-	case 0x0F: return "envelope You #4";
-	case 0x12: return "folio";
-	case 0x15: return "Kai-32";
-	case 0x19: return "legal";
-	case 0x1A: return "G.legal";
-	case 0x1B: return "letter";
-	case 0x1D: return "G.letter";
-	case 0x1F: return "executive";
-	case 0x21: return "statement";
-	case 0x24: return "envelope monarch";
-	case 0x25: return "envelope COM10";
-	case 0x26: return "envelope DL";
-	case 0x27: return "envelope C5";
-	case 0x28: return "envelope C6";
-	case 0x29: return "B5 (ISO)";
-	case 0x2D: return "envelope Chou #3";
-	case 0x2E: return "envelope Chou #4";
-	case 0x31: return "CUSTOM";
-	case 0x46: return "foolscap";
-	case 0x51: return "16K";
-	case 0x52: return "Kai-16";
-	case 0x53: return "letter plus";
-	case 0x54: return "UK quarto";
-	case 0x65: return "photo";
-	default:   return "unknown";
-	}
-}
+void write_pbm_header(void *priv, const struct block_page *page) {
+	FILE *fout = priv;
+	int nbands = (page->color_mode == MODE_COLOR) ? 4 : 1;
 
-void output_byte(FILE *fout, u8 b) {
-	if (model == M2400W)	/* interleaved lines */
-		line_buf[buf_pos % 2 * line_bytes + buf_pos / 2] = b;
-	else
-		line_buf[buf_pos] = b;
-	buf_pos++;
-	if (buf_pos >= 2 * line_bytes) {
-		fwrite(line_buf, 1, 2 * line_bytes, fout);
-		buf_pos = 0;
-	}
+	fseek(fout, 0, SEEK_SET);
+	fprintf(fout, "P4\n%d %d\n", le16_to_cpu(page->x_end), le16_to_cpu(page->y_end) * nbands);
 }
 
-void output_rep(FILE *fout, u8 byte, int count)
-{
-	for (int i = 0; i < count; i++)
-		output_byte(fout, byte);
+void write_raster(void *priv, const u8 *data, int len) {
+	fwrite(data, 1, len, priv);
 }
 
-void decode_begin_block(void *data) {
-	struct block_begin *begin = data;
-
-	model = begin->model;
-	printf("Printer model: %s\n", decode_model(model));
-}
+#define MAX_ERRORS	64
 
-void decode_params_block(void *data) {
-	struct block_params *params = data;
-	int dpi_x, dpi_y = 600;
+struct validation {
+	unsigned long blocks;
+	unsigned long pages;
+	int errors;
+	bool first;
+};
 
-	if (params->res_y != RES_600DPI || (params->res_y == RES_1200DPI && model != M2300W))
-		fprintf(stderr, "Invalid vertical resolution: 0x%02hhx\n", params->res_y);
-	switch (params->res_x) {
-	case RES_MULT1:
-		dpi_x = dpi_y;
-		break;
-	case RES_MULT2:
-		dpi_x = 2 * dpi_y;
-		break;
-	case RES_MULT4:
-		dpi_x = 4 * dpi_y;
-		break;
-	default:
-		dpi_x = 0;
-		fprintf(stderr, "Invalid X resolution multiplier: 0x%02hhx\n", params->res_x);
-	}
-	printf("Print parameters: resolution %dx%d dpi\n", dpi_x, dpi_y);
+void count_block(void *priv, const struct header *header, const void *data, long offset) {
+	struct validation *val = priv;
+	(void)header; (void)data; (void)offset;
+	val->blocks++;
 }
 
-void decode_page_block(void *data, FILE *fout) {
-	struct block_page *page = data;
-	int page_width = le16_to_cpu(page->x_end);
-	int page_height = le16_to_cpu(page->y_end);
-	int nbands = (page->color_mode == MODE_COLOR) ? 4 : 1;
-
-	line_bytes = DIV_ROUND_UP(page_width, 8);
-	printf("Page parameters: paper %x (%s), size %d x %d pixels\n",
-		page->paper_size, decode_paper_size(page->paper_size), page_width, page_height);////
-
-	fseek(fout, SEEK_SET, 0);
-	fprintf(fout, "P4\n%d %d\n", page_width, page_height * nbands);
-	line_buf = realloc(line_buf, 2 * line_bytes);
+void count_page(void *priv, const struct block_page *page) {
+	struct validation *val = priv;
+	(void)page;
+	val->pages++;
 }
 
-void decode_data_block(void *data, FILE *f, FILE *fout) {
-	struct block_data *header = data;
-	int nbytes = le32_to_cpu(header->data_len);
-	int lines = le16_to_cpu(header->lines);
-	int line_bytes_virt = line_bytes;
-
-	printf("  Raster data: ch%d, #%d, %d bytes compressed, %d uncompressed lines are %d bytes each\n",
-		header->color, header->block_num, nbytes, lines, line_bytes_virt);
+void record_error(void *priv, enum m2x00w_decode_error err, long offset, const char *msg) {
+	struct validation *val = priv;
 
-	buf_pos = 0;
-
-	if (model == M2400W) {
-		lines /= 2;
-		line_bytes_virt *= 2;
-	}
-	for (int line = 0; line < lines; line++) {
-		u8 table[16];
-		u8 table_len;
+	if (++val->errors > MAX_ERRORS)
+		return;
+	printf("%s{\"error\":\"%s\",\"offset\":%ld,\"message\":", val->first ? "" : ",",
+		m2x00w_decode_error_name(err), offset);
+	m2x00w_json_string(stdout, msg);
+	printf("}");
+	val->first = false;
+}
 
-		printf("POS=0x%lx, line=%d: ", ftell(f), line);
-		fread(&table_len, 1, 1, f);
-		printf("table_len=0x%02hhx\n", table_len);
-		if (!(table_len & 0x80))
-			fprintf(stderr, "Invalid line start byte 0x%02hhx!\n", table_len);
-		if (table_len & 0x40) { /* 4-byte row length padding (2500W) */
-			if (model != M2500W)
-				fprintf(stderr, "2500W padding present but printer is not 2500W!\n");
-			fread(table, 1, 2, f);
-			int pad_len = table[0] >> 6; /* 0, 1, 2 or 3 bytes */
-			int row_len = ((table[0] & 0x3f) << 8) | table[1];
-			printf("row size: %d, reading %d padding bytes\n", row_len, pad_len);
-			fread(table, 1, pad_len, f);
-		} else
-			if (model == M2500W)
-				fprintf(stderr, "2500W padding missing!\n");
-		table_len &= 0x3f;
-		if (table_len > 16) {
-			fprintf(stderr, "Table too big: %d bytes!\n", table_len);
-			return;
+/* check structure of files without decoding the raster, print one JSON line per file */
+int validate(int count, char *files[]) {
+	static const struct m2x00w_decoder_ops ops = {
+		.error = record_error,
+		.block = count_block,
+		.page = count_page,
+	};
+	static u8 buf[1024 * 1024];
+	int ret = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct validation val = { .first = true };
+		struct m2x00w_decoder *dec;
+		unsigned long bytes = 0;
+		size_t len;
+		FILE *f;
+
+		f = fopen(files[i], "r");
+		if (!f) {
+			const char *msg = strerror(errno);
+
+			printf("{\"file\":");
+			m2x00w_json_string(stdout, files[i]);
+			printf(",\"errors\":[{\"error\":\"open\",\"offset\":0,\"message\":");
+			m2x00w_json_string(stdout, msg);
+			printf("}],\"errors_truncated\":false,\"valid\":false,\"bytes\":0,\"blocks\":0,\"pages\":0}\n");
+			ret = 2;
+			continue;
 		}
-		fread(table, 1, table_len, f);
-		printf("table: ");
-		for (int i = 0; i < table_len; i++)
-			printf("%02hhx ", table[i]);
-		printf("\n");
-		int pos = 0;
-		while (pos < line_bytes_virt) {
-			u8 b = fgetc(f);
-			int count = b & 0x3f;
-			switch (b & 0xc0) {
-			case 0xc0: /* long repeated bytes */
-				count <<= 6;
-				/* fall through */
-			case 0x80: /* short repeated bytes */
-				if (count == 0)
-					fprintf(stderr, "zero repeat count!");
-				u8 byte = fgetc(f);
-				printf("%s repeat: %d-times 0x%02hhx\n", (b >= 0xc0) ? "long" : "short", count, byte);
-				output_rep(fout, byte, count);
-				pos += count;
-				break;
-			case 0x40: /* table */
-				printf("%d bytes from table\n", 2 * (count + 1));
-				for (int i = 0; i < count + 1; i++) {
-					u8 idx = fgetc(f);
-					printf("table %d:0x%02hhx %d:0x%02hhx\n", (idx >> 4) & 0x0f, table[(idx >> 4) & 0x0f], idx & 0x0f, table[idx & 0x0f]);
-					output_byte(fout, table[(idx >> 4) & 0x0f]);
-					output_byte(fout, table[idx & 0x0f]);
-				}
-				pos += 2 * (count + 1);
-				break;
-			case 0x00: /* uncompressed bytes */
-				printf("uncompressed %d bytes: ", count + 1);
-				for (int i = 0; i < count + 1; i++) {
-					u8 byte = fgetc(f);
-					printf("%02hhx ", byte);
-					output_byte(fout, byte);
-				}
-				pos += count + 1;
-				printf("\n");
-				break;
-			}
+		dec = m2x00w_decoder_new(&ops, &val);
+		if (!dec) {
+			fprintf(stderr, "Memory allocation error\n");
+			fclose(f);
+			return 2;
 		}
-		if (pos != line_bytes_virt) {
-			fprintf(stderr, "Wrong line length %d!\n", pos);
-			return;
+		printf("{\"file\":");
+		m2x00w_json_string(stdout, files[i]);
+		printf(",\"errors\":[");
+		while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+			bytes += len;
+			/* stop on fatal errors or when a damaged file produces too many */
+			if (m2x00w_decoder_push(dec, buf, len) || val.errors > MAX_ERRORS)
+				break;
 		}
+		if (ferror(f))
+			record_error(&val, M2X00W_ERR_TRUNCATED, bytes, strerror(errno));
+		else if (feof(f))
+			m2x00w_decoder_finish(dec);
+		printf("],\"errors_truncated\":%s,\"valid\":%s,\"bytes\":%lu,\"blocks\":%lu,\"pages\":%lu}\n",
+			val.errors > MAX_ERRORS ? "true" : "false", val.errors ? "false" : "true",
+			bytes, val.blocks, val.pages);
+		if (val.errors && !ret)
+			ret = 1;
+		m2x00w_decoder_free(dec);
+		fclose(f);
 	}
-	if (buf_pos) /* flush last line if needed */
-		fwrite(line_buf, 1, buf_pos, fout);
-}
-
-void min_parse_block(FILE *f, FILE *fout)
-{
-	struct header header;
-	u8 sum, sum_header;
-	u8 *data;
-
-	fread(&header, 1, sizeof(header), f);
-	int len = le16_to_cpu(header.len);
-
-	if (feof(f))
-		return;
-
-	if (header.magic != M2X00W_MAGIC)
-		fprintf(stderr, "Invalid block magic byte 0x%02hhx!\n", header.magic);
-	printf("Block type 0x%02hhx: seq %d, length %d\n", header.type, header.seq, len);
-	if (header.type != (header.type_inv ^ 0xff))
-		fprintf(stderr, "Invalid inverted block type byte 0x%02hhx!\n", header.type_inv);
-
-	data = malloc(len);
-	fread(data, 1, len, f);
-	printf("  Data: ");
-	for (int i = 0; i < len; i++)
-		printf("%02hhx ", data[i]);
-	printf("\n");
-
-	fread(&sum_header, 1, 1, f);
-	sum = checksum(&header, sizeof(header)) + checksum(data, len);
-	if (sum_header != sum)
-		fprintf(stderr, "Incorrect checksum 0x%02hhx, should be 0x%02hhx!\n", sum_header, sum);
 
-	switch (header.type) {
-	case M2X00W_BLOCK_BEGIN:
-		decode_begin_block(data);
-		break;
-	case M2X00W_BLOCK_PARAMS:
-		decode_params_block(data);
-		break;
-	case M2X00W_BLOCK_PAGE:
-		decode_page_block(data, fout);
-		break;
-	case M2X00W_BLOCK_DATA:
-		decode_data_block(data, f, fout);
-		break;
-	case M2X00W_BLOCK_ENDPART:
-		break;
-	case M2X00W_BLOCK_END:
-		break;
-	default:
-		printf("Unknown block type 0x%02hhx\n", header.type);
-		exit(1);
-	}
-	printf("\n");
-	free(data);
+	return ret;
 }
 
 void usage() {
 	printf("usage: m2x00w-decode <file.prn> <outfile.pbm>\n");
+	printf("       m2x00w-decode --validate <file.prn>...\n");
 }
 
 int main(int argc, char *argv[]) {
+	static const struct m2x00w_decoder_ops ops = {
+		.trace = print_trace,
+		.error = print_error,
+		.page = write_pbm_header,
+		.raster = write_raster,
+	};
+	struct m2x00w_decoder *dec;
+	u8 buf[65536];
+	size_t len;
+	int ret = 0;
+
+	if (argc >= 3 && !strcmp(argv[1], "--validate"))
+		return validate(argc - 2, argv + 2);
 	if (argc < 3) {
 		usage();
 		return 1;
@@ -296,13 +157,27 @@ int main(int argc, char *argv[]) {
 		return 2;
 	}
 
-	while (!feof(f))
-		min_parse_block(f, fout);
+	dec = m2x00w_decoder_new(&ops, fout);
+	if (!dec) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 2;
+	}
+	while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+		if (m2x00w_decoder_push(dec, buf, len)) {
+			ret = 1;
+			break;
+		}
+	if (ferror(f)) {
+		perror("Read error");
+		ret = 2;
+	} else if (!ret && m2x00w_decoder_finish(dec))
+		ret = 1;
 
-	printf("End of file reached\n");
+	if (!ret)
+		printf("End of file reached\n");
 
-	free(line_buf);
+	m2x00w_decoder_free(dec);
 	fclose(fout);
 	fclose(f);
-	return 0;
+	return ret;
 }
@@ -0,0 +1,679 @@
+/* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers - decoder library */
+/* Copyright (c) 2014 Ondrej Zary */
+/* Based on min_decode by Orion Sky Lawlor, olawlor@acm.org */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "m2x00w.h"
+
+/* longest possible encoded line: start byte, padding, table, each byte encoded as two */
+#define LINE_WORST_CASE(len)	(1 + 5 + 16 + 2 * (u64)(len))
+
+#define TRACE(dec, fmt, args ...)	do { if ((dec)->ops->trace) trace(dec, fmt, ##args); } while (0)
+
+enum decoder_state { STATE_HEADER, STATE_PAYLOAD, STATE_DATA, STATE_FAILED };
+/* position in the BEGIN, PARAMS, PAGE..., ENDPART, END sequence of a job */
+enum job_state { JOB_NONE, JOB_BEGIN, JOB_PARAMS, JOB_ENDPART };
+
+struct m2x00w_decoder {
+	const struct m2x00w_decoder_ops *ops;
+	void *priv;
+	enum m2x00w_model model;
+	/* raster output */
+	int line_bytes;
+	u8 *line_buf;
+	int buf_pos;
+	/* input */
+	enum decoder_state state;
+	long offset;		/* stream offset of the next byte */
+	long block_offset;	/* stream offset of the current block (or raster data) */
+	struct header header;
+	u8 *acc;		/* bytes of the current block collected so far */
+	int acc_len;
+	size_t acc_size;
+	int want;		/* bytes needed to complete the current state */
+	/* protocol structure checks */
+	enum job_state job;
+	bool have_seq;
+	u8 last_seq;
+	bool in_page;
+	long page_offset;
+	bool color_page;
+	int page_lines;
+	int blocks1;		/* data blocks announced in page parameters */
+	int blocks;		/* data blocks found */
+	int plane_lines[4];
+	int next_block[4];
+};
+
+/* raster data being decoded */
+struct reader {
+	const u8 *data;
+	int len;
+	int pos;
+	long offset;
+};
+
+static void trace(struct m2x00w_decoder *dec, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	dec->ops->trace(dec->priv, fmt, ap);
+	va_end(ap);
+}
+
+static void report(struct m2x00w_decoder *dec, enum m2x00w_decode_error err, long offset, const char *fmt, ...) {
+	char msg[128];
+	va_list ap;
+
+	if (!dec->ops->error)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	dec->ops->error(dec->priv, err, offset, msg);
+}
+
+const char *m2x00w_decode_error_name(enum m2x00w_decode_error err) {
+	static const char *names[] = {
+		[M2X00W_ERR_MAGIC]		= "magic",
+		[M2X00W_ERR_TYPE_INV]		= "type_inv",
+		[M2X00W_ERR_CHECKSUM]		= "checksum",
+		[M2X00W_ERR_BLOCK_TYPE]		= "block_type",
+		[M2X00W_ERR_BLOCK_LEN]		= "block_len",
+		[M2X00W_ERR_RESOLUTION]		= "resolution",
+		[M2X00W_ERR_NO_PAGE]		= "no_page",
+		[M2X00W_ERR_LINE_START]		= "line_start",
+		[M2X00W_ERR_PADDING]		= "padding",
+		[M2X00W_ERR_TABLE]		= "table",
+		[M2X00W_ERR_REPEAT]		= "repeat",
+		[M2X00W_ERR_LINE_LENGTH]	= "line_length",
+		[M2X00W_ERR_TRUNCATED]		= "truncated",
+		[M2X00W_ERR_SEQUENCE]		= "sequence",
+		[M2X00W_ERR_BLOCK_COUNT]	= "block_count",
+		[M2X00W_ERR_DATA_LEN]		= "data_len",
+		[M2X00W_ERR_GEOMETRY]		= "geometry",
+		[M2X00W_ERR_FRAMING]		= "framing",
+	};
+
+	if (err < ARRAY_SIZE(names) && names[err])
+		return names[err];
+	return "unknown";
+}
+
+static const char *decode_model(u8 model) {
+	switch (model) {
+	case 0x81: return "1200W/1250W";
+	case 0x82: return "2300W";
+	case 0x83: return "1300W/1350W";
+	case 0x85: return "2400W";
+	case 0x87: return "2500W";
+	default:   return "unknown";
+	}
+}
+
+static const char *decode_paper_size(u8 paper) {
+	switch (paper) {
+	case 0x04: return "A4";
+	case 0x06: return "B5 (JIS)";
+	case 0x08: return "A5";
+	case 0x0C: return "J postcard";
+	case 0x0D: return "double postcard";
+	case 0x0F: return "envelope You #4";
+	case 0x12: return "folio";
+	case 0x15: return "Kai-32";
+	case 0x19: return "legal";
+	case 0x1A: return "G.legal";
+	case 0x1B: return "letter";
+	case 0x1D: return "G.letter";
+	case 0x1F: return "executive";
+	case 0x21: return "statement";
+	case 0x24: return "envelope monarch";
+	case 0x25: return "envelope COM10";
+	case 0x26: return "envelope DL";
+	case 0x27: return "envelope C5";
+	case 0x28: return "envelope C6";
+	case 0x29: return "B5 (ISO)";
+	case 0x2D: return "envelope Chou #3";
+	case 0x2E: return "envelope Chou #4";
+	case 0x31: return "CUSTOM";
+	case 0x46: return "foolscap";
+	case 0x51: return "16K";
+	case 0x52: return "Kai-16";
+	case 0x53: return "letter plus";
+	case 0x54: return "UK quarto";
+	case 0x65: return "photo";
+	default:   return "unknown";
+	}
+}
+
+static void output_flush(struct m2x00w_decoder *dec) {
+	if (dec->buf_pos && dec->ops->raster)
+		dec->ops->raster(dec->priv, dec->line_buf, dec->buf_pos);
+	dec->buf_pos = 0;
+}
+
+static void output_byte(struct m2x00w_decoder *dec, u8 b) {
+	if (dec->model == M2400W)	/* interleaved lines */
+		dec->line_buf[dec->buf_pos % 2 * dec->line_bytes + dec->buf_pos / 2] = b;
+	else
+		dec->line_buf[dec->buf_pos] = b;
+	dec->buf_pos++;
+	if (dec->buf_pos >= 2 * dec->line_bytes)
+		output_flush(dec);
+}
+
+static void output_rep(struct m2x00w_decoder *dec, u8 byte, int count)
+{
+	for (int i = 0; i < count; i++)
+		output_byte(dec, byte);
+}
+
+static int read_byte(struct reader *r) {
+	if (r->pos >= r->len)
+		return -1;
+	return r->data[r->pos++];
+}
+
+static int read_bytes(struct reader *r, u8 *buf, int len) {
+	if (r->pos + len > r->len)
+		return -1;
+	memcpy(buf, r->data + r->pos, len);
+	r->pos += len;
+
+	return 0;
+}
+
+static int read_skip(struct reader *r, int len) {
+	if (r->pos + len > r->len)
+		return -1;
+	r->pos += len;
+
+	return 0;
+}
+
+static void decode_begin_block(struct m2x00w_decoder *dec, void *data) {
+	struct block_begin *begin = data;
+
+	dec->model = begin->model;
+	TRACE(dec, "Printer model: %s\n", decode_model(dec->model));
+}
+
+static void decode_params_block(struct m2x00w_decoder *dec, void *data) {
+	struct block_params *params = data;
+	int dpi_x, dpi_y = 600;
+
+	if (params->res_y != RES_600DPI && !(params->res_y == RES_1200DPI && dec->model == M2300W))
+		report(dec, M2X00W_ERR_RESOLUTION, dec->block_offset, "Invalid vertical resolution: 0x%02hhx", params->res_y);
+	switch (params->res_x) {
+	case RES_MULT1:
+		dpi_x = dpi_y;
+		break;
+	case RES_MULT2:
+		dpi_x = 2 * dpi_y;
+		break;
+	case RES_MULT4:
+		dpi_x = 4 * dpi_y;
+		break;
+	default:
+		dpi_x = 0;
+		report(dec, M2X00W_ERR_RESOLUTION, dec->block_offset, "Invalid X resolution multiplier: 0x%02hhx", params->res_x);
+	}
+	TRACE(dec, "Print parameters: resolution %dx%d dpi\n", dpi_x, dpi_y);
+}
+
+static int decode_page_block(struct m2x00w_decoder *dec, void *data) {
+	struct block_page *page = data;
+	int page_width = le16_to_cpu(page->x_end);
+	int page_height = le16_to_cpu(page->y_end);
+	u8 *line_buf;
+
+	dec->line_bytes = DIV_ROUND_UP(page_width, 8);
+	TRACE(dec, "Page parameters: paper %x (%s), size %d x %d pixels\n",
+		page->paper_size, decode_paper_size(page->paper_size), page_width, page_height);
+	if (page->paper_size == PAPER_CUSTOM)
+		TRACE(dec, "Custom paper size: %d x %d mm\n", le16_to_cpu(page->custom_width), le16_to_cpu(page->custom_height));
+
+	if (page_width == 0 || page_height == 0)
+		report(dec, M2X00W_ERR_GEOMETRY, dec->block_offset, "Invalid page size %d x %d!", page_width, page_height);
+	if (page->blocks1 != page->blocks2)
+		report(dec, M2X00W_ERR_BLOCK_COUNT, dec->block_offset, "Block counts differ: %d and %d!",
+			le16_to_cpu(page->blocks1), le16_to_cpu(page->blocks2));
+
+	line_buf = realloc(dec->line_buf, 2 * dec->line_bytes + 1);
+	if (!line_buf)
+		return -1;
+	dec->line_buf = line_buf;
+
+	dec->in_page = true;
+	dec->page_offset = dec->block_offset;
+	dec->color_page = (page->color_mode == MODE_COLOR);
+	dec->page_lines = page_height;
+	dec->blocks1 = le16_to_cpu(page->blocks1);
+	dec->blocks = 0;
+	for (int i = 0; i < 4; i++) {
+		dec->plane_lines[i] = 0;
+		dec->next_block[i] = 1;
+	}
+	if (dec->ops->page)
+		dec->ops->page(dec->priv, page);
+
+	return 0;
+}
+
+/* check that the page just finished matches its page parameters */
+static void check_page(struct m2x00w_decoder *dec) {
+	if (!dec->in_page)
+		return;
+	dec->in_page = false;
+	if (dec->blocks != dec->blocks1)
+		report(dec, M2X00W_ERR_BLOCK_COUNT, dec->page_offset, "Page has %d data blocks, page parameters say %d!",
+			dec->blocks, dec->blocks1);
+	for (int color = COLOR_K; color <= COLOR_Y; color++) {
+		if (color != COLOR_K && !dec->color_page) {
+			if (dec->plane_lines[color])
+				report(dec, M2X00W_ERR_GEOMETRY, dec->page_offset, "Color %d data in BW page!", color);
+		} else if (dec->plane_lines[color] != dec->page_lines)
+			report(dec, M2X00W_ERR_GEOMETRY, dec->page_offset, "Color %d has %d lines, page has %d!",
+				color, dec->plane_lines[color], dec->page_lines);
+	}
+}
+
+/* check order of the job framing blocks */
+static void check_framing(struct m2x00w_decoder *dec, u8 type, const void *data) {
+	switch (type) {
+	case M2X00W_BLOCK_BEGIN:
+		if (dec->job != JOB_NONE)
+			report(dec, M2X00W_ERR_FRAMING, dec->block_offset, "BEGIN block inside a job!");
+		dec->job = JOB_BEGIN;
+		break;
+	case M2X00W_BLOCK_PARAMS:
+		if (dec->job != JOB_BEGIN && dec->job != JOB_PARAMS)
+			report(dec, M2X00W_ERR_FRAMING, dec->block_offset, "PARAMS block outside of job start!");
+		dec->job = JOB_PARAMS;
+		break;
+	case M2X00W_BLOCK_PAGE:
+		if (dec->job != JOB_PARAMS)
+			report(dec, M2X00W_ERR_FRAMING, dec->block_offset, "PAGE block without print parameters!");
+		break;
+	case M2X00W_BLOCK_ENDPART:
+		if (dec->job != JOB_BEGIN && dec->job != JOB_PARAMS)
+			report(dec, M2X00W_ERR_FRAMING, dec->block_offset, "ENDPART block outside of job!");
+		/* pages continue after waiting for manual duplex */
+		if (((const struct block_endpart *)data)->type == 0x00)
+			dec->job = JOB_ENDPART;
+		break;
+	case M2X00W_BLOCK_END:
+		if (dec->job != JOB_ENDPART)
+			report(dec, M2X00W_ERR_FRAMING, dec->block_offset, "END block without ENDPART!");
+		dec->job = JOB_NONE;
+		break;
+	}
+}
+
+static void check_data_block(struct m2x00w_decoder *dec, struct block_data *header) {
+	int lines = le16_to_cpu(header->lines);
+
+	dec->blocks++;
+	if (header->color > COLOR_Y) {
+		report(dec, M2X00W_ERR_GEOMETRY, dec->block_offset, "Invalid color %d!", header->color);
+		return;
+	}
+	if (header->block_num != dec->next_block[header->color])
+		report(dec, M2X00W_ERR_SEQUENCE, dec->block_offset, "Data block #%d of color %d, expected #%d!",
+			header->block_num, header->color, dec->next_block[header->color]);
+	dec->next_block[header->color] = header->block_num + 1;
+	if (lines == 0 || (dec->model == M2400W && lines % 2))
+		report(dec, M2X00W_ERR_GEOMETRY, dec->block_offset, "Invalid number of lines %d!", lines);
+	dec->plane_lines[header->color] += lines;
+}
+
+static void decode_data_block(struct m2x00w_decoder *dec, struct block_data *header, struct reader *r) {
+	int lines = le16_to_cpu(header->lines);
+	int line_bytes_virt = dec->line_bytes;
+	/* without output and trace, only the structure is checked */
+	bool fast = !dec->ops->raster && !dec->ops->trace;
+
+	dec->buf_pos = 0;
+
+	if (dec->model == M2400W) {
+		lines /= 2;
+		line_bytes_virt *= 2;
+	}
+	for (int line = 0; line < lines; line++) {
+		u8 table[16] = { 0 };
+		int table_len;
+
+		TRACE(dec, "POS=0x%lx, line=%d: ", r->offset + r->pos, line);
+		if ((table_len = read_byte(r)) < 0)
+			goto truncated;
+		TRACE(dec, "table_len=0x%02hhx\n", table_len);
+		if (!(table_len & 0x80))
+			report(dec, M2X00W_ERR_LINE_START, r->offset + r->pos - 1, "Invalid line start byte 0x%02hhx!", table_len);
+		if (table_len & 0x40) { /* 4-byte row length padding (2500W) */
+			if (dec->model != M2500W)
+				report(dec, M2X00W_ERR_PADDING, r->offset + r->pos - 1, "2500W padding present but printer is not 2500W!");
+			if (read_bytes(r, table, 2))
+				goto truncated;
+			int pad_len = table[0] >> 6; /* 0, 1, 2 or 3 bytes */
+			int row_len = ((table[0] & 0x3f) << 8) | table[1];
+			TRACE(dec, "row size: %d, reading %d padding bytes\n", row_len, pad_len);
+			if (read_bytes(r, table, pad_len))
+				goto truncated;
+		} else
+			if (dec->model == M2500W)
+				report(dec, M2X00W_ERR_PADDING, r->offset + r->pos - 1, "2500W padding missing!");
+		table_len &= 0x3f;
+		if (table_len > 16) {
+			report(dec, M2X00W_ERR_TABLE, r->offset + r->pos - 1, "Table too big: %d bytes!", table_len);
+			return;
+		}
+		if (read_bytes(r, table, table_len))
+			goto truncated;
+		TRACE(dec, "table: ");
+		for (int i = 0; i < table_len; i++)
+			TRACE(dec, "%02hhx ", table[i]);
+		TRACE(dec, "\n");
+		int pos = 0;
+		while (pos < line_bytes_virt) {
+			int b = read_byte(r);
+			if (b < 0)
+				goto truncated;
+			int count = b & 0x3f;
+			switch (b & 0xc0) {
+			case 0xc0: /* long repeated bytes */
+				count <<= 6;
+				/* fall through */
+			case 0x80: /* short repeated bytes */
+				if (count == 0)
+					report(dec, M2X00W_ERR_REPEAT, r->offset + r->pos - 1, "zero repeat count!");
+				int byte = read_byte(r);
+				if (byte < 0)
+					goto truncated;
+				TRACE(dec, "%s repeat: %d-times 0x%02hhx\n", (b >= 0xc0) ? "long" : "short", count, byte);
+				if (!fast)
+					output_rep(dec, byte, count);
+				pos += count;
+				break;
+			case 0x40: /* table */
+				TRACE(dec, "%d bytes from table\n", 2 * (count + 1));
+				if (fast && read_skip(r, count + 1))
+					goto truncated;
+				for (int i = 0; !fast && i < count + 1; i++) {
+					int idx = read_byte(r);
+					if (idx < 0)
+						goto truncated;
+					TRACE(dec, "table %d:0x%02hhx %d:0x%02hhx\n", (idx >> 4) & 0x0f, table[(idx >> 4) & 0x0f], idx & 0x0f, table[idx & 0x0f]);
+					output_byte(dec, table[(idx >> 4) & 0x0f]);
+					output_byte(dec, table[idx & 0x0f]);
+				}
+				pos += 2 * (count + 1);
+				break;
+			case 0x00: /* uncompressed bytes */
+				TRACE(dec, "uncompressed %d bytes: ", count + 1);
+				if (fast && read_skip(r, count + 1))
+					goto truncated;
+				for (int i = 0; !fast && i < count + 1; i++) {
+					int byte = read_byte(r);
+					if (byte < 0)
+						goto truncated;
+					TRACE(dec, "%02hhx ", byte);
+					output_byte(dec, byte);
+				}
+				pos += count + 1;
+				TRACE(dec, "\n");
+				break;
+			}
+		}
+		if (pos != line_bytes_virt) {
+			report(dec, M2X00W_ERR_LINE_LENGTH, r->offset + r->pos, "Wrong line length %d!", pos);
+			return;
+		}
+	}
+	output_flush(dec); /* flush last line if needed */
+	if (r->pos != r->len)
+		report(dec, M2X00W_ERR_DATA_LEN, r->offset + r->pos, "Data length %d but raster data is %d bytes!",
+			r->len, r->pos);
+	return;
+
+truncated:
+	report(dec, M2X00W_ERR_TRUNCATED, r->offset + r->pos, "Raster data shorter than data length!");
+	output_flush(dec);
+}
+
+static int acc_reserve(struct m2x00w_decoder *dec, size_t size) {
+	if (dec->acc_size < size) {
+		u8 *acc = realloc(dec->acc, size);
+
+		if (!acc)
+			return -1;
+		dec->acc = acc;
+		dec->acc_size = size;
+	}
+
+	return 0;
+}
+
+/* wait for the next block */
+static void expect_header(struct m2x00w_decoder *dec) {
+	dec->state = STATE_HEADER;
+	dec->want = sizeof(struct header);
+	dec->acc_len = 0;
+	dec->block_offset = dec->offset;
+}
+
+static int fail(struct m2x00w_decoder *dec) {
+	dec->state = STATE_FAILED;
+	return -1;
+}
+
+static int parse_header(struct m2x00w_decoder *dec) {
+	struct header *header = &dec->header;
+	int len;
+
+	memcpy(header, dec->acc, sizeof(*header));
+	len = le16_to_cpu(header->len);
+	if (header->magic != M2X00W_MAGIC)
+		report(dec, M2X00W_ERR_MAGIC, dec->block_offset, "Invalid block magic byte 0x%02hhx!", header->magic);
+	TRACE(dec, "Block type 0x%02hhx: seq %d, length %d\n", header->type, header->seq, len);
+	if (header->type != (header->type_inv ^ 0xff))
+		report(dec, M2X00W_ERR_TYPE_INV, dec->block_offset, "Invalid inverted block type byte 0x%02hhx!", header->type_inv);
+	/* numbering starts again with each job */
+	if (dec->have_seq && header->type != M2X00W_BLOCK_BEGIN && header->seq != (u8)(dec->last_seq + 1))
+		report(dec, M2X00W_ERR_SEQUENCE, dec->block_offset, "Block sequence number %d, expected %d!",
+			header->seq, (u8)(dec->last_seq + 1));
+	dec->have_seq = true;
+	dec->last_seq = header->seq;
+
+	/* block data followed by checksum */
+	if (acc_reserve(dec, len + 1))
+		return fail(dec);
+	dec->state = STATE_PAYLOAD;
+	dec->want = len + 1;
+	dec->acc_len = 0;
+
+	return 0;
+}
+
+static size_t block_min_len(u8 type) {
+	switch (type) {
+	case M2X00W_BLOCK_BEGIN:	return sizeof(struct block_begin);
+	case M2X00W_BLOCK_PARAMS:	return sizeof(struct block_params);
+	case M2X00W_BLOCK_PAGE:		return sizeof(struct block_page);
+	case M2X00W_BLOCK_DATA:		return sizeof(struct block_data);
+	case M2X00W_BLOCK_ENDPART:	return sizeof(struct block_endpart);
+	default:			return 0;
+	}
+}
+
+static int parse_payload(struct m2x00w_decoder *dec) {
+	struct header *header = &dec->header;
+	int len = dec->want - 1;
+	u8 *data = dec->acc;
+	u8 sum;
+
+	TRACE(dec, "  Data: ");
+	for (int i = 0; i < len; i++)
+		TRACE(dec, "%02hhx ", data[i]);
+	TRACE(dec, "\n");
+
+	sum = checksum(header, sizeof(*header)) + checksum(data, len);
+	if (data[len] != sum)
+		report(dec, M2X00W_ERR_CHECKSUM, dec->block_offset, "Incorrect checksum 0x%02hhx, should be 0x%02hhx!", data[len], sum);
+
+	if ((size_t)len < block_min_len(header->type)) {
+		report(dec, M2X00W_ERR_BLOCK_LEN, dec->block_offset, "Block too short: %d bytes!", len);
+		TRACE(dec, "\n");
+		expect_header(dec);
+		return 0;
+	}
+	if (dec->ops->block)
+		dec->ops->block(dec->priv, header, data, dec->block_offset);
+	check_framing(dec, header->type, data);
+
+	switch (header->type) {
+	case M2X00W_BLOCK_BEGIN:
+		decode_begin_block(dec, data);
+		break;
+	case M2X00W_BLOCK_PARAMS:
+		decode_params_block(dec, data);
+		break;
+	case M2X00W_BLOCK_PAGE:
+		check_page(dec);
+		if (decode_page_block(dec, data))
+			return fail(dec);
+		break;
+	case M2X00W_BLOCK_DATA: {
+		struct block_data *data_header = (struct block_data *)data;
+		u32 nbytes = le32_to_cpu(data_header->data_len);
+		u64 max_len = le16_to_cpu(data_header->lines) * LINE_WORST_CASE(dec->line_bytes);
+
+		TRACE(dec, "  Raster data: ch%d, #%d, %u bytes compressed, %d uncompressed lines are %d bytes each\n",
+			data_header->color, data_header->block_num, nbytes, le16_to_cpu(data_header->lines), dec->line_bytes);
+		if (!dec->in_page)
+			report(dec, M2X00W_ERR_NO_PAGE, dec->block_offset, "Raster data outside of page!");
+		else
+			check_data_block(dec, data_header);
+		/* don't let a corrupted length allocate unlimited memory */
+		if (nbytes > max_len) {
+			report(dec, M2X00W_ERR_DATA_LEN, dec->block_offset, "Data length %u too big for %d lines!",
+				nbytes, le16_to_cpu(data_header->lines));
+			return fail(dec);
+		}
+		/* the data block header stays in front of the raster data */
+		if (acc_reserve(dec, sizeof(struct block_data) + nbytes))
+			return fail(dec);
+		dec->state = STATE_DATA;
+		dec->want = nbytes;
+		dec->acc_len = 0;
+		dec->block_offset = dec->offset;
+		return 0;
+	}
+	case M2X00W_BLOCK_ENDPART:
+	case M2X00W_BLOCK_END:
+		check_page(dec);
+		break;
+	default:
+		report(dec, M2X00W_ERR_BLOCK_TYPE, dec->block_offset, "Unknown block type 0x%02hhx!", header->type);
+		return fail(dec);
+	}
+	TRACE(dec, "\n");
+	expect_header(dec);
+
+	return 0;
+}
+
+static void parse_data(struct m2x00w_decoder *dec) {
+	struct reader r = {
+		.data = dec->acc + sizeof(struct block_data),
+		.len = dec->want,
+		.offset = dec->block_offset,
+	};
+
+	if (dec->line_buf)
+		decode_data_block(dec, (struct block_data *)dec->acc, &r);
+	TRACE(dec, "\n");
+	expect_header(dec);
+}
+
+struct m2x00w_decoder *m2x00w_decoder_new(const struct m2x00w_decoder_ops *ops, void *priv) {
+	struct m2x00w_decoder *dec = calloc(1, sizeof(*dec));
+
+	if (!dec)
+		return NULL;
+	dec->ops = ops;
+	dec->priv = priv;
+	if (acc_reserve(dec, 256)) {
+		free(dec);
+		return NULL;
+	}
+	expect_header(dec);
+
+	return dec;
+}
+
+void m2x00w_decoder_free(struct m2x00w_decoder *dec) {
+	if (!dec)
+		return;
+	free(dec->line_buf);
+	free(dec->acc);
+	free(dec);
+}
+
+int m2x00w_decoder_push(struct m2x00w_decoder *dec, const void *data, size_t len) {
+	const u8 *p = data;
+
+	while (len > 0 || (dec->state != STATE_FAILED && dec->acc_len == dec->want)) {
+		int chunk;
+		u8 *dst;
+
+		if (dec->state == STATE_FAILED)
+			return -1;
+		dst = dec->acc + dec->acc_len;
+		if (dec->state == STATE_DATA)
+			dst += sizeof(struct block_data);
+		chunk = dec->want - dec->acc_len;
+		if ((size_t)chunk > len)
+			chunk = len;
+		memcpy(dst, p, chunk);
+		dec->acc_len += chunk;
+		dec->offset += chunk;
+		p += chunk;
+		len -= chunk;
+		if (dec->acc_len < dec->want)
+			break;
+
+		switch (dec->state) {
+		case STATE_HEADER:
+			parse_header(dec);
+			break;
+		case STATE_PAYLOAD:
+			parse_payload(dec);
+			break;
+		case STATE_DATA:
+			parse_data(dec);
+			break;
+		case STATE_FAILED:
+			break;
+		}
+	}
+
+	return (dec->state == STATE_FAILED) ? -1 : 0;
+}
+
+int m2x00w_decoder_finish(struct m2x00w_decoder *dec) {
+	if (dec->state == STATE_FAILED)
+		return -1;
+	if (dec->state != STATE_HEADER || dec->acc_len) {
+		report(dec, M2X00W_ERR_TRUNCATED, dec->offset, "Unexpected end of file!");
+		return -1;
+	}
+	check_page(dec);
+	if (dec->offset == 0)
+		report(dec, M2X00W_ERR_FRAMING, 0, "No data!");
+	else if (dec->job != JOB_NONE)
+		report(dec, M2X00W_ERR_FRAMING, dec->offset, "Job has no END block!");
+
+	return 0;
+}
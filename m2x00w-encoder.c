@@ -0,0 +1,609 @@
+/* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers - encoder library */
+/* Copyright (c) 2014 Ondrej Zary */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "m2x00w.h"
+
+/* worst case: start byte + 5-byte padding + each byte encoded as two */
+#define LINE_WORST_CASE(len)	(1 + 5 + 2 * (len))
+
+struct m2x00w_buf {
+	u8 *data;
+	int size;
+	int pos;
+};
+
+struct m2x00w_encoder {
+	enum m2x00w_model model;
+	u64 (*popcount)(const u8 *data, int len);
+	bool count_dots;
+	bool estimate;			/* only compute output size */
+	m2x00w_sink_t sink;
+	void *sink_priv;
+	const char *error;
+	u8 block_seq;
+	bool params_written;
+	/* current page */
+	bool in_page;
+	struct block_page page_params;
+	int height;
+	int line_len;
+	u16 lines_per_block;
+	u16 blocks;			/* data blocks per plane */
+	enum m2x00w_color color;	/* plane being encoded */
+	int line;			/* lines of the current plane received */
+	u8 data_block_seq;
+	struct m2x00w_page_stats stats;
+	/* buffers, kept across pages */
+	struct m2x00w_buf buf;		/* current data block */
+	struct m2x00w_buf empty_buf;	/* empty data blocks in lazy color mode */
+	u8 *line_data;			/* interleaved line + first line of pair (2400W) */
+	u8 *zero_line;
+	int line_alloc;
+};
+
+int m2x00w_stdio_sink(void *priv, const void *data, size_t len) {
+	FILE *stream = priv;
+
+	if (fwrite(data, 1, len, stream) != len)
+		return -1;
+
+	return 0;
+}
+
+void m2x00w_json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static inline __attribute__((always_inline)) u64 popcount_line(const u8 *data, int len) {
+	u64 count = 0;
+	int i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		u64 word;
+
+		memcpy(&word, data + i, sizeof(word));
+		count += __builtin_popcountll(word);
+	}
+	for (; i < len; i++)
+		count += __builtin_popcount(data[i]);
+
+	return count;
+}
+
+static u64 popcount_generic(const u8 *data, int len) {
+	return popcount_line(data, len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* same code using POPCNT instruction, selected at runtime */
+__attribute__((target("popcnt")))
+static u64 popcount_hw(const u8 *data, int len) {
+	return popcount_line(data, len);
+}
+#endif
+
+static int set_error(struct m2x00w_encoder *enc, const char *error) {
+	if (!enc->error)
+		enc->error = error;
+
+	return -1;
+}
+
+static int enc_write(struct m2x00w_encoder *enc, const void *data, size_t len) {
+	if (enc->error)
+		return -1;
+	enc->stats.bytes += len;
+	if (!enc->estimate && enc->sink(enc->sink_priv, data, len))
+		return set_error(enc, "Write error");
+
+	return 0;
+}
+
+static int write_block(struct m2x00w_encoder *enc, u8 block_type, void *data, u8 data_len)
+{
+	struct header header;
+	u8 sum;
+
+	header.magic = M2X00W_MAGIC;
+	header.type = block_type;
+	header.seq = enc->block_seq++;
+	header.len = cpu_to_le16(data_len);
+	header.type_inv = block_type ^ 0xff;
+	sum = checksum(&header, sizeof(header)) + checksum(data, data_len);
+
+	if (enc_write(enc, &header, sizeof(header)) ||
+	    enc_write(enc, data, data_len) ||
+	    enc_write(enc, &sum, sizeof(sum)))
+		return -1;
+
+	return 0;
+}
+
+/* buf is NULL when only the encoded size is computed */
+static inline void buf_add(const void *data, int len, struct m2x00w_buf *buf) {
+	if (!buf)
+		return;
+	/* space is checked by caller for the whole line */
+	memcpy(buf->data + buf->pos, data, len);
+	buf->pos += len;
+}
+
+static u32 encode_raw(const u8 *data, int len, struct m2x00w_buf *buf) {
+	u32 out_len = 0;
+
+	while (len > 0) {
+		u8 chunk = (len > 64) ? 64 : len;
+		u8 count = chunk - 1;
+
+		buf_add(&count, 1, buf);
+		buf_add(data, chunk, buf);
+		out_len += chunk + 1;
+		data += chunk;
+		len -= chunk;
+	}
+
+	return out_len;
+}
+
+static u32 encode_rle(u8 byte, int count, struct m2x00w_buf *buf) {
+	u8 repeat;
+	u32 out_len = 0;
+
+	if (count >= 4096) {
+		/* encode 4096B run as two 2048B runs (happens only on 2400W at 2400dpi) */
+		repeat = 0xe0;
+		buf_add(&repeat, 1, buf);
+		buf_add(&byte, 1, buf);
+		buf_add(&repeat, 1, buf);
+		buf_add(&byte, 1, buf);
+		out_len += 4;
+		count -= 4096;
+	}
+	if (count / 64 > 0) {
+		repeat = 0xc0 + count / 64;
+		buf_add(&repeat, 1, buf);
+		buf_add(&byte, 1, buf);
+		out_len += 2;
+		count -= count / 64 * 64;
+	}
+	if (count > 0) {
+		repeat = 0x80 + count;
+		buf_add(&repeat, 1, buf);
+		buf_add(&byte, 1, buf);
+		out_len += 2;
+	}
+
+	return out_len;
+}
+
+static u32 encode_line(enum m2x00w_model model, const u8 *data, int len, struct m2x00w_buf *buf, bool *empty) {
+	u8 last = data[0];
+	int raw_pos = 0, run_len = 0;
+	u8 empty_table = 0x80;
+	u32 out_len = 0;
+
+	*empty = true;
+
+	buf_add(&empty_table, 1, buf);
+	out_len += 1;
+
+	for (int i = 0; i < len; i++) {
+		if (*empty && data[i] != 0x00)
+			*empty = false;
+		if (data[i] == last) {
+			run_len++;
+		} else {
+			if (run_len > 2) {
+				out_len += encode_raw(data + raw_pos, i - raw_pos - run_len, buf);
+				out_len += encode_rle(last, run_len, buf);
+				raw_pos = i;
+			}
+			run_len = 1;
+		}
+		last = data[i];
+	}
+	if (run_len < 3)
+		run_len = 0;
+	out_len += encode_raw(data + raw_pos, len - raw_pos - run_len, buf);
+	out_len += encode_rle(last, run_len, buf);
+
+	/* padding for 2500W */
+	if (model == M2500W) {
+		u8 pad_header[2];
+		/* compute padding length for the row length to be multiple of 4 */
+		u8 padlen = (4 - ((out_len + sizeof(pad_header)) % 4)) % 4;
+		u8 padding[] = { 0xff, 0xff, 0xff };
+		int rowlen = out_len + sizeof(pad_header) + padlen;
+
+		if (buf) {
+			u8 *start = buf->data + buf->pos - out_len;
+
+			pad_header[0] = (padlen << 6) | ((rowlen >> 8) & 0x3f);
+			pad_header[1] = rowlen & 0xff;
+			/* make space for pad_header and padding */
+			memmove(start + 1 + sizeof(pad_header) + padlen, start + 1, out_len - 1);
+			/* insert pad_header and padding */
+			memcpy(start + 1, pad_header, sizeof(pad_header));
+			memcpy(start + 1 + sizeof(pad_header), padding, padlen);
+			start[0] |= 0x40;
+			buf->pos += sizeof(pad_header) + padlen;
+		}
+		out_len = rowlen;
+	}
+
+	return out_len;
+}
+
+static int write_data_block(struct m2x00w_encoder *enc, enum m2x00w_color color, struct m2x00w_buf *buf, u8 block_num, u16 lines) {
+	struct block_data header = {
+		.data_len = cpu_to_le32(buf->pos),
+		.color = color,
+		.block_num = block_num,
+		.lines = cpu_to_le16(lines),
+	};
+
+	if ((u32)buf->pos > enc->stats.max_band)
+		enc->stats.max_band = buf->pos;
+	/* in estimate mode, only buf->pos is valid */
+	if (write_block(enc, M2X00W_BLOCK_DATA, &header, sizeof(header)) ||
+	    enc_write(enc, buf->data, buf->pos))
+		return -1;
+
+	return 0;
+}
+
+/* make room for size bytes, data already in the buffer are kept */
+static int buf_reserve(struct m2x00w_buf *buf, int size) {
+	if (buf->size < size) {
+		int new_size = (2 * buf->size > size) ? 2 * buf->size : size;
+		u8 *data = realloc(buf->data, new_size);
+
+		if (!data)
+			return -1;
+		buf->data = data;
+		buf->size = new_size;
+	}
+
+	return 0;
+}
+
+/* length of the lines passed to encode_line() */
+static int encoded_line_len(struct m2x00w_encoder *enc) {
+	return (enc->model == M2400W) ? 2 * enc->line_len : enc->line_len;
+}
+
+/* output data blocks with no dots covering the first lines of a plane */
+static int write_empty_blocks(struct m2x00w_encoder *enc, enum m2x00w_color color, int lines) {
+	int len = encoded_line_len(enc);
+	int step = (enc->model == M2400W) ? 2 : 1;
+	u8 block_num = 1;
+	bool empty;
+	/* all empty lines encode to the same size */
+	int line_size = encode_line(enc->model, enc->zero_line, len, NULL, &empty);
+
+	if (enc->model == M2400W)
+		lines = ROUND_UP_MULTIPLE(lines, 2);
+	if (!enc->estimate && buf_reserve(&enc->empty_buf, line_size * enc->lines_per_block / step))
+		return set_error(enc, "Memory allocation error");
+	for (int line = 0; line < lines; line += enc->lines_per_block) {
+		int block_lines = lines - line;
+
+		if (block_lines > enc->lines_per_block)
+			block_lines = enc->lines_per_block;
+		enc->empty_buf.pos = 0;
+		for (int i = 0; i < block_lines; i += step)
+			if (enc->estimate)
+				enc->empty_buf.pos += line_size;
+			else
+				encode_line(enc->model, enc->zero_line, len, &enc->empty_buf, &empty);
+		if (write_data_block(enc, color, &enc->empty_buf, block_num++, block_lines))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int write_page_params(struct m2x00w_encoder *enc) {
+	return write_block(enc, M2X00W_BLOCK_PAGE, &enc->page_params, sizeof(enc->page_params));
+}
+
+/*
+ * Lazy color mode:
+ * We don't output any data as long as zero color bytes are coming.
+ * So if all YMC color bytes are zero, the page is printed in BW mode, increasing print speed.
+ * This means that when we found the first non-zero byte in any of YMC colors, we need to output
+ * everything that we omitted before (in the hope that it won't be needed):
+ *  - all previous empty colors (Y and M when we're in C, only Y when in M and nothing in Y)
+ *  - empty blocks of the current color
+ * This method might seem a bit strange but it saves us from buffering large amounts of data.
+ */
+static int start_color_mode(struct m2x00w_encoder *enc) {
+	enum m2x00w_color color = enc->color;
+
+	/* we found first non-zero color byte: set mode to color and output the page params */
+	enc->page_params.color_mode = MODE_COLOR;
+	enc->page_params.blocks1 = enc->page_params.blocks2 = cpu_to_le16(enc->blocks * 4);
+	if (write_page_params(enc))
+		return -1;
+	/* now we have to output the empty color data we omitted before */
+	if (color == COLOR_C || color == COLOR_M)	/* output empty Y */
+		if (write_empty_blocks(enc, COLOR_Y, enc->height))
+			return -1;
+	if (color == COLOR_C)	/* output empty M */
+		if (write_empty_blocks(enc, COLOR_M, enc->height))
+			return -1;
+	/* output empty blocks of the current color that we omitted before */
+	return write_empty_blocks(enc, color, (enc->data_block_seq - 1) * enc->lines_per_block);
+}
+
+/* output data only if encoding black or we have found a non-empty color byte */
+static bool plane_output(struct m2x00w_encoder *enc) {
+	return enc->color == COLOR_K || enc->page_params.color_mode == MODE_COLOR;
+}
+
+static int end_plane(struct m2x00w_encoder *enc) {
+	if (enc->line % enc->lines_per_block && plane_output(enc))
+		if (write_data_block(enc, enc->color, &enc->buf, enc->data_block_seq, enc->line % enc->lines_per_block))
+			return -1;
+	enc->buf.pos = 0;
+	enc->line = 0;
+	enc->data_block_seq = 1;
+	if (enc->color == COLOR_K) {
+		int planes = (enc->page_params.color_mode == MODE_COLOR) ? 4 : 1;
+
+		enc->stats.raster_bytes = (u64)enc->line_len * le16_to_cpu(enc->page_params.y_end) * planes;
+		enc->in_page = false;
+		return 0;
+	}
+	enc->color--;
+	/* in color mode, page params were already written */
+	if (enc->color == COLOR_K && enc->page_params.color_mode != MODE_COLOR)
+		return write_page_params(enc);
+
+	return 0;
+}
+
+static int add_line(struct m2x00w_encoder *enc, const u8 *data) {
+	int len = enc->line_len;
+	bool empty;
+
+	if (enc->model == M2400W) { /* interleaved lines */
+		u8 *first = enc->line_data + 2 * len;
+
+		if (enc->line % 2 == 0) {
+			/* keep the first line until the second one of the pair arrives */
+			memcpy(first, data, len);
+			if (++enc->line < enc->height)
+				return 0;
+			/* odd height: last line is paired with an empty one */
+			data = enc->zero_line;
+		}
+		for (int i = 0; i < len; i++) {
+			enc->line_data[2 * i] = first[i];
+			enc->line_data[2 * i + 1] = data[i];
+		}
+		data = enc->line_data;
+		len *= 2;
+	}
+	enc->line++;
+
+	if (enc->estimate)
+		enc->buf.pos += encode_line(enc->model, data, len, NULL, &empty);
+	else {
+		/* the buffer grows to the largest band actually encoded */
+		if (buf_reserve(&enc->buf, enc->buf.pos + LINE_WORST_CASE(len)))
+			return set_error(enc, "Memory allocation error");
+		encode_line(enc->model, data, len, &enc->buf, &empty);
+	}
+	/* empty lines are common and need no counting */
+	if (enc->count_dots && !empty)
+		enc->stats.dots[enc->color] += enc->popcount(data, len);
+
+	if (enc->page_params.color_mode != MODE_COLOR && enc->color != COLOR_K && !empty)
+		if (start_color_mode(enc))
+			return -1;
+	if (enc->line % enc->lines_per_block == 0) {
+		if (plane_output(enc))
+			if (write_data_block(enc, enc->color, &enc->buf, enc->data_block_seq, enc->lines_per_block))
+				return -1;
+		enc->data_block_seq++;
+		enc->buf.pos = 0;
+	}
+	if (enc->line >= enc->height)
+		return end_plane(enc);
+
+	return 0;
+}
+
+static int reserve_lines(struct m2x00w_encoder *enc, int line_len) {
+	if (enc->line_alloc < line_len) {
+		u8 *line_data = realloc(enc->line_data, 3 * line_len);
+		u8 *zero_line = calloc(2, line_len);
+
+		if (line_data)
+			enc->line_data = line_data;
+		if (!line_data || !zero_line) {
+			free(zero_line);
+			return -1;
+		}
+		free(enc->zero_line);
+		enc->zero_line = zero_line;
+		enc->line_alloc = line_len;
+	}
+
+	return 0;
+}
+
+struct m2x00w_encoder *m2x00w_encoder_new(enum m2x00w_model model, m2x00w_sink_t sink, void *priv) {
+	struct m2x00w_encoder *enc;
+
+	if (model != M2300W && model != M2400W && model != M2500W)
+		return NULL;
+	enc = calloc(1, sizeof(*enc));
+	if (!enc)
+		return NULL;
+	enc->model = model;
+	enc->sink = sink;
+	enc->sink_priv = priv;
+	enc->popcount = popcount_generic;
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("popcnt"))
+		enc->popcount = popcount_hw;
+#endif
+
+	return enc;
+}
+
+void m2x00w_encoder_free(struct m2x00w_encoder *enc) {
+	if (!enc)
+		return;
+	free(enc->buf.data);
+	free(enc->empty_buf.data);
+	free(enc->line_data);
+	free(enc->zero_line);
+	free(enc);
+}
+
+void m2x00w_encoder_set_sink(struct m2x00w_encoder *enc, m2x00w_sink_t sink, void *priv) {
+	enc->sink = sink;
+	enc->sink_priv = priv;
+}
+
+void m2x00w_encoder_count_dots(struct m2x00w_encoder *enc, bool enable) {
+	enc->count_dots = enable;
+}
+
+void m2x00w_encoder_estimate(struct m2x00w_encoder *enc, bool enable) {
+	enc->estimate = enable;
+}
+
+const struct m2x00w_page_stats *m2x00w_encoder_page_stats(struct m2x00w_encoder *enc) {
+	return &enc->stats;
+}
+
+const char *m2x00w_encoder_error(struct m2x00w_encoder *enc) {
+	return enc->error;
+}
+
+int m2x00w_encoder_begin_job(struct m2x00w_encoder *enc) {
+	struct block_begin begin = { .model = enc->model, .color = 0x10 };
+
+	enc->error = NULL;
+	enc->block_seq = 0;
+	enc->params_written = false;
+	enc->in_page = false;
+
+	/* document beginning */
+	return write_block(enc, M2X00W_BLOCK_BEGIN, &begin, sizeof(begin));
+}
+
+int m2x00w_encoder_begin_page(struct m2x00w_encoder *enc, const struct m2x00w_page_info *info) {
+	enum m2x00w_model model = enc->model;
+	int bands = info->bands ? info->bands : BLOCKS_PER_PAGE;
+
+	if (enc->in_page && m2x00w_encoder_end_page(enc))
+		return -1;
+	if (info->height <= 0 || info->line_len <= 0)
+		return set_error(enc, "Invalid page size");
+
+	enc->height = info->height;
+	enc->line_len = info->line_len;
+	if (bands < 1 || bands > MAX_BLOCKS_PER_PAGE)
+		return set_error(enc, "Invalid number of bands");
+	/* smaller bands need less memory and get the first data to the printer sooner */
+	enc->lines_per_block = DIV_ROUND_UP(info->height, bands);
+	/* 2400W lines are encoded in pairs that must not be split between blocks */
+	if (model == M2400W)
+		enc->lines_per_block = ROUND_UP_MULTIPLE(enc->lines_per_block, 2);
+	/* rounding can leave fewer blocks than requested on short pages */
+	enc->blocks = DIV_ROUND_UP(info->height, enc->lines_per_block);
+	if (reserve_lines(enc, info->line_len))
+		return set_error(enc, "Memory allocation error");
+	enc->buf.pos = 0;
+	/* page size includes print parameters written before the first page */
+	enc->stats = (struct m2x00w_page_stats) { .pixels = (u64)info->width * info->height };
+
+	if (!enc->params_written) {	/* print parameters */
+		struct block_params params = { .res_y = (model == M2300W) ? RES_1200DPI : RES_600DPI };
+		if (info->dpi == 600)
+			params.res_x = RES_MULT1;
+		else if (info->dpi == 1200)
+			params.res_x = RES_MULT2;
+		else if (info->dpi == 2400)
+			params.res_x = RES_MULT4;
+		if (write_block(enc, M2X00W_BLOCK_PARAMS, &params, sizeof(params)))
+			return -1;
+		enc->params_written = true;
+	}
+
+	enc->page_params = (struct block_page) {
+		.color_mode = (model == M2300W) ? MODE_BW_2300 : MODE_BW,
+		.copies = (model == M2500W) ? info->copies : 1,
+		.x_end = cpu_to_le16(ROUND_UP_MULTIPLE(info->width, 8)),
+		.y_end = cpu_to_le16((model == M2400W) ? ROUND_UP_MULTIPLE(info->height, 2) : info->height),
+		.blocks1 = cpu_to_le16(enc->blocks),
+		.blocks2 = cpu_to_le16(enc->blocks),
+		.paper_size = info->paper_size,
+		.custom_width = cpu_to_le16((info->paper_size == PAPER_CUSTOM) ? info->custom_width : 0),
+		.custom_height = cpu_to_le16((info->paper_size == PAPER_CUSTOM) ? info->custom_height : 0),
+		.paper_weight = info->media_type,
+		.unknown = (model == M2300W) ? 1 : 0,
+	};
+	enc->color = info->color ? COLOR_Y : COLOR_K;
+	enc->line = 0;
+	enc->data_block_seq = 1;
+	enc->in_page = true;
+
+	/* page params of color pages are written in lazy color mode or before the K plane */
+	if (!info->color)
+		return write_page_params(enc);
+
+	return 0;
+}
+
+int m2x00w_encoder_push_lines(struct m2x00w_encoder *enc, const u8 *data, int lines) {
+	if (enc->error)
+		return -1;
+	for (int i = 0; i < lines; i++) {
+		if (!enc->in_page)
+			return set_error(enc, "Too much raster data");
+		if (add_line(enc, data))
+			return -1;
+		data += enc->line_len;
+	}
+
+	return 0;
+}
+
+int m2x00w_encoder_end_page(struct m2x00w_encoder *enc) {
+	/* missing raster data (e.g. truncated input) is printed blank */
+	while (enc->in_page)
+		if (add_line(enc, enc->zero_line))
+			return -1;
+
+	return enc->error ? -1 : 0;
+}
+
+int m2x00w_encoder_end_job(struct m2x00w_encoder *enc) {
+	char zero = 0;
+
+	if (enc->in_page && m2x00w_encoder_end_page(enc))
+		return -1;
+	/* end of print data */
+	if (write_block(enc, M2X00W_BLOCK_ENDPART, &zero, 1))
+		return -1;
+	/* end of document */
+	return write_block(enc, M2X00W_BLOCK_END, &zero, 1);
+}
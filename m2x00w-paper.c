@@ -0,0 +1,70 @@
+/* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers - paper sizes */
+/* Copyright (c) 2014 Ondrej Zary */
+#include <stdlib.h>
+#include <string.h>
+#include "m2x00w.h"
+
+/* PPD and PWG media names, sorted by strcmp() order for bsearch() (checked by make check) */
+const struct m2x00w_paper m2x00w_papers[] = {
+	{ "A4",				PAPER_A4 },
+	{ "A5",				PAPER_A5 },
+	{ "B5",				PAPER_B5_JIS },
+	{ "C5",				PAPER_ENV_C5 },
+	{ "DL",				PAPER_ENV_DL },
+	{ "DoublePostcard",		PAPER_D_POSTCARD },
+	{ "DoublePostcardRotated",	PAPER_D_POSTCARD },
+	{ "Env10",			PAPER_ENV_COM10 },
+	{ "EnvC5",			PAPER_ENV_C5 },
+	{ "EnvC6",			PAPER_ENV_C6 },
+	{ "EnvChou3",			PAPER_ENV_CHOU3 },
+	{ "EnvChou4",			PAPER_ENV_CHOU4 },
+	{ "EnvDL",			PAPER_ENV_DL },
+	{ "EnvMonarch",			PAPER_ENV_MONARCH },
+	{ "EnvYou4",			PAPER_ENV_YOU4 },
+	{ "Executive",			PAPER_EXECUTIVE },
+	{ "Folio",			PAPER_FOLIO },
+	{ "ISOB5",			PAPER_B5_ISO },
+	{ "Legal",			PAPER_LEGAL },
+	{ "Letter",			PAPER_LETTER },
+	{ "LetterPlus",			PAPER_LETTER_PLUS },
+	{ "Monarch",			PAPER_ENV_MONARCH },
+	{ "Postcard",			PAPER_J_POSTCARD },
+	{ "Quarto",			PAPER_UK_QUARTO },
+	{ "Statement",			PAPER_STATEMENT },
+	{ "iso_a4_210x297mm",		PAPER_A4 },
+	{ "iso_a5_148x210mm",		PAPER_A5 },
+	{ "iso_b5_176x250mm",		PAPER_B5_ISO },
+	{ "iso_c5_162x229mm",		PAPER_ENV_C5 },
+	{ "iso_c6_114x162mm",		PAPER_ENV_C6 },
+	{ "iso_dl_110x220mm",		PAPER_ENV_DL },
+	{ "jis_b5_182x257mm",		PAPER_B5_JIS },
+	{ "jpn_chou3_120x235mm",	PAPER_ENV_CHOU3 },
+	{ "jpn_chou4_90x205mm",		PAPER_ENV_CHOU4 },
+	{ "jpn_hagaki_100x148mm",	PAPER_J_POSTCARD },
+	{ "jpn_oufuku_148x200mm",	PAPER_D_POSTCARD },
+	{ "jpn_you4_105x235mm",		PAPER_ENV_YOU4 },
+	{ "na_executive_7.25x10.5in",	PAPER_EXECUTIVE },
+	{ "na_index-4x6_4x6in",		PAPER_PHOTO_10X15 },
+	{ "na_invoice_5.5x8.5in",	PAPER_STATEMENT },
+	{ "na_legal_8.5x14in",		PAPER_LEGAL },
+	{ "na_letter-plus_8.5x12.69in",	PAPER_LETTER_PLUS },
+	{ "na_letter_8.5x11in",		PAPER_LETTER },
+	{ "na_monarch_3.875x7.5in",	PAPER_ENV_MONARCH },
+	{ "na_number-10_4.125x9.5in",	PAPER_ENV_COM10 },
+	{ "na_quarto_8.5x10.83in",	PAPER_UK_QUARTO },
+	{ "om_folio_210x330mm",		PAPER_FOLIO },
+	{ "om_small-photo_100x150mm",	PAPER_PHOTO_10X15 },
+};
+
+const size_t m2x00w_num_papers = ARRAY_SIZE(m2x00w_papers);
+
+static int paper_cmp(const void *name, const void *paper) {
+	return strcmp(name, ((const struct m2x00w_paper *)paper)->name);
+}
+
+/* everything else (including Custom.WxH) is printed as custom size */
+enum m2x00w_paper_size m2x00w_paper_size(const char *name) {
+	const struct m2x00w_paper *paper = bsearch(name, m2x00w_papers, m2x00w_num_papers, sizeof(m2x00w_papers[0]), paper_cmp);
+
+	return paper ? paper->code : PAPER_CUSTOM;
+}
@@ -1,10 +1,17 @@
 /* CUPS driver for Minolta magicolor 2300W/2400W/2500W printers */
 /* Copyright (c) 2014 Ondrej Zary */
+#ifndef M2X00W_H
+#define M2X00W_H
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define u8 uint8_t
 #define u16 uint16_t
 #define u32 uint32_t
+#define u64 uint64_t
 
 #define POINTS_PER_INCH 72
 
@@ -20,7 +27,8 @@
 #define le32_to_cpu(x) (x)
 #endif
 
-#define BLOCKS_PER_PAGE		8
+#define BLOCKS_PER_PAGE		8	/* default number of bands (data blocks) per plane */
+#define MAX_BLOCKS_PER_PAGE	255	/* block_num is 8-bit */
 
 #define M2X00W_MAGIC		0x1B
 struct header {
@@ -122,9 +130,9 @@ struct block_endpart {
 	unsigned char type;	/* 00=end job 10=wait for button (manual duplex) */
 } __attribute__((packed));
 
-u8 checksum(void *p, int length) {
+static inline u8 checksum(const void *p, int length) {
 	u8 sum = 0;
-	u8 *data = p;
+	const u8 *data = p;
 
 	for (int i = 0; i < length; i++) {
 		sum += *data;
@@ -133,3 +141,133 @@ u8 checksum(void *p, int length) {
 
 	return sum;
 }
+
+/*
+ * libm2x00w - reentrant encoder and decoder
+ *
+ * All state lives in the encoder/decoder objects, so any number of them
+ * can be used concurrently (one object must not be shared between threads).
+ */
+
+/* output sink: must consume all len bytes, returns 0 on success, -1 on error */
+typedef int (*m2x00w_sink_t)(void *priv, const void *data, size_t len);
+
+/* sink writing to a stdio stream, priv is the FILE * */
+int m2x00w_stdio_sink(void *priv, const void *data, size_t len);
+
+/* write s as a quoted JSON string, NULL is written as "" */
+void m2x00w_json_string(FILE *f, const char *s);
+
+/* PPD and PWG media names, sorted by strcmp() order */
+struct m2x00w_paper {
+	const char *name;
+	enum m2x00w_paper_size code;
+};
+
+extern const struct m2x00w_paper m2x00w_papers[];
+extern const size_t m2x00w_num_papers;
+
+/* paper size code for a media name, PAPER_CUSTOM if unknown */
+enum m2x00w_paper_size m2x00w_paper_size(const char *name);
+
+struct m2x00w_page_info {
+	int width;		/* pixels */
+	int height;		/* lines */
+	int line_len;		/* bytes per line (of one color plane) */
+	int dpi;		/* horizontal resolution: 600, 1200 or 2400 */
+	bool color;		/* Y, M, C and K planes follow, otherwise K only */
+	unsigned int copies;
+	enum m2x00w_paper_size paper_size;
+	int custom_width;	/* mm, only for PAPER_CUSTOM */
+	int custom_height;
+	u8 media_type;
+	int bands;		/* data blocks per plane, 0 = BLOCKS_PER_PAGE */
+};
+
+struct m2x00w_page_stats {
+	u64 dots[4];		/* printed dots per color plane, indexed by enum m2x00w_color */
+	u64 pixels;		/* pixels of one plane */
+	u64 bytes;		/* printer data of the page (predicted in estimate mode) */
+	u64 raster_bytes;	/* uncompressed raster data of the planes sent */
+	u32 max_band;		/* largest compressed data block */
+};
+
+struct m2x00w_encoder;
+
+struct m2x00w_encoder *m2x00w_encoder_new(enum m2x00w_model model, m2x00w_sink_t sink, void *priv);
+void m2x00w_encoder_free(struct m2x00w_encoder *enc);
+/* change output of an encoder that is reused for more jobs */
+void m2x00w_encoder_set_sink(struct m2x00w_encoder *enc, m2x00w_sink_t sink, void *priv);
+int m2x00w_encoder_begin_job(struct m2x00w_encoder *enc);
+int m2x00w_encoder_begin_page(struct m2x00w_encoder *enc, const struct m2x00w_page_info *info);
+/* lines are pushed plane after plane: Y, M, C, K for color pages, only K otherwise */
+int m2x00w_encoder_push_lines(struct m2x00w_encoder *enc, const u8 *data, int lines);
+int m2x00w_encoder_end_page(struct m2x00w_encoder *enc);
+int m2x00w_encoder_end_job(struct m2x00w_encoder *enc);
+/* count printed dots of each plane (ink coverage accounting), off by default */
+void m2x00w_encoder_count_dots(struct m2x00w_encoder *enc, bool enable);
+/* only compute the exact output size into page statistics, nothing is written to the sink */
+void m2x00w_encoder_estimate(struct m2x00w_encoder *enc, bool enable);
+/* statistics of the last page, complete after m2x00w_encoder_end_page() */
+const struct m2x00w_page_stats *m2x00w_encoder_page_stats(struct m2x00w_encoder *enc);
+/* description of the first error, NULL if none */
+const char *m2x00w_encoder_error(struct m2x00w_encoder *enc);
+
+/*
+ * Output capture: sink that passes data to another sink and saves a copy into
+ * <dir>/m2x00w-<date>-<time>-<pid>-<job>.prn with block index in .idx (written by a
+ * separate thread). Oldest captures are removed to keep dir under max_bytes.
+ */
+struct m2x00w_capture;
+
+struct m2x00w_capture *m2x00w_capture_start(const char *dir, const char *job, u64 max_bytes, m2x00w_sink_t sink, void *priv);
+int m2x00w_capture_sink(void *priv, const void *data, size_t len);	/* priv is the capture */
+void m2x00w_capture_finish(struct m2x00w_capture *cap);
+
+enum m2x00w_decode_error {
+	M2X00W_ERR_MAGIC,	/* invalid block magic byte */
+	M2X00W_ERR_TYPE_INV,	/* inverted block type mismatch */
+	M2X00W_ERR_CHECKSUM,	/* block checksum mismatch */
+	M2X00W_ERR_BLOCK_TYPE,	/* unknown block type (fatal) */
+	M2X00W_ERR_BLOCK_LEN,	/* block too short for its type */
+	M2X00W_ERR_RESOLUTION,	/* invalid resolution in params block */
+	M2X00W_ERR_NO_PAGE,	/* raster data without page parameters */
+	M2X00W_ERR_LINE_START,	/* invalid line start byte */
+	M2X00W_ERR_PADDING,	/* 2500W padding missing or unexpected */
+	M2X00W_ERR_TABLE,	/* table too big */
+	M2X00W_ERR_REPEAT,	/* zero repeat count */
+	M2X00W_ERR_LINE_LENGTH,	/* decoded line length mismatch */
+	M2X00W_ERR_TRUNCATED,	/* data ends in the middle of a block */
+	M2X00W_ERR_SEQUENCE,	/* block or data block number out of sequence */
+	M2X00W_ERR_BLOCK_COUNT,	/* number of data blocks differs from page parameters */
+	M2X00W_ERR_DATA_LEN,	/* data length differs from raster data size */
+	M2X00W_ERR_GEOMETRY,	/* raster lines or colors don't match the page */
+	M2X00W_ERR_FRAMING,	/* missing or misplaced BEGIN, PARAMS, ENDPART or END block, no data */
+};
+
+/* short name of an error, e.g. "checksum" */
+const char *m2x00w_decode_error_name(enum m2x00w_decode_error err);
+
+struct m2x00w_decoder_ops {
+	/* human readable trace of everything decoded (optional) */
+	void (*trace)(void *priv, const char *fmt, va_list ap);
+	/* protocol error found at stream offset */
+	void (*error)(void *priv, enum m2x00w_decode_error err, long offset, const char *msg);
+	/* complete block parsed, data blocks are reported before their raster data */
+	void (*block)(void *priv, const struct header *header, const void *data, long offset);
+	/* page parameters of a new page */
+	void (*page)(void *priv, const struct block_page *page);
+	/* decoded raster data, 2400W lines are already de-interleaved */
+	void (*raster)(void *priv, const u8 *data, int len);
+};
+
+struct m2x00w_decoder;
+
+struct m2x00w_decoder *m2x00w_decoder_new(const struct m2x00w_decoder_ops *ops, void *priv);
+void m2x00w_decoder_free(struct m2x00w_decoder *dec);
+/* feed any amount of data, returns -1 after a fatal error */
+int m2x00w_decoder_push(struct m2x00w_decoder *dec, const void *data, size_t len);
+/* end of data, returns -1 if a fatal error occured or the last block is incomplete */
+int m2x00w_decoder_finish(struct m2x00w_decoder *dec);
+
+#endif
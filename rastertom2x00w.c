@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <unistd.h>
 #include <cups/ppd.h>
 #include <cups/raster.h>
 #include "m2x00w.h"
@@ -24,30 +25,6 @@
 #define DBG(fmt, args ...)	do {} while (0)
 #endif
 
-enum m2x00w_model model;
-u8 block_seq;
-int buf_size;
-u16 line_len_file;
-int width, height, dpi;
-struct block_page page_params;
-
-void write_block(u8 block_type, void *data, u8 data_len, FILE *stream)
-{
-	struct header header;
-	u8 sum;
-
-	header.magic = M2X00W_MAGIC;
-	header.type = block_type;
-	header.seq = block_seq++;
-	header.len = cpu_to_le16(data_len);
-	header.type_inv = block_type ^ 0xff;
-	sum = checksum(&header, sizeof(header)) + checksum(data, data_len);
-
-	fwrite(&header, 1, sizeof(header), stream);
-	fwrite(data, 1, data_len, stream);
-	fwrite(&sum, 1, sizeof(sum), stream);
-}
-
 int fls(unsigned int n) {
 	int i = 0;
 
@@ -57,236 +34,9 @@ int fls(unsigned int n) {
 	return i;
 }
 
-enum m2x00w_paper_size encode_paper_size(const char *paper_size_name) {
-	if (!strcmp(paper_size_name, "A4"))
-		return PAPER_A4;
-	else if (!strcmp(paper_size_name, "A5"))
-		return PAPER_A5;
-//	else if (!strcmp(paper_size_name, "B5"))
-//		return PAPER_B5;
-	else if (!strcmp(paper_size_name, "Letter"))
-		return PAPER_LETTER;
-	else if (!strcmp(paper_size_name, "Legal"))
-		return PAPER_LEGAL;
-	else if (!strcmp(paper_size_name, "Executive"))
-		return PAPER_EXECUTIVE;
-	else if (!strcmp(paper_size_name, "Monarch"))
-		return PAPER_ENV_MONARCH;
-	else if (!strcmp(paper_size_name, "Env10"))
-		return PAPER_ENV_COM10;
-	else if (!strcmp(paper_size_name, "DL"))
-		return PAPER_ENV_DL;
-	else if (!strcmp(paper_size_name, "C5"))
-		return PAPER_ENV_C5;
-	else
-		return PAPER_CUSTOM;
-}
-
-void buf_add(void *data, int len, u8 *buf, int *buf_pos) {
-	if (*buf_pos + len > buf_size) {
-		ERR("buffer overflow");
-		exit(1);
-	}
-	memcpy(buf + *buf_pos, data, len);
-	*buf_pos += len;
-}
-
-u32 encode_raw(u8 *data, int len, u8 *buf, int *buf_pos) {
-	u32 out_len = 0;
-
-//	DBG("%d raw bytes\n", len);
-	while (len > 0) {
-		u8 chunk = (len > 64) ? 64 : len;
-		u8 count = chunk - 1;
-
-		buf_add(&count, 1, buf, buf_pos);
-		buf_add(data, chunk, buf, buf_pos);
-		out_len += chunk + 1;
-		data += chunk;
-		len -= chunk;
-	}
-
-	return out_len;
-}
-
-u32 encode_rle(u8 byte, int count, u8 *buf, int *buf_pos) {
-	u8 repeat;
-	u32 out_len = 0;
-
-//	DBG("%d times 0x%02x\n", count, byte);
-	if (count >= 4096) {
-		/* encode 4096B run as two 2048B runs (happens only on 2400W at 2400dpi) */
-		repeat = 0xe0;
-		buf_add(&repeat, 1, buf, buf_pos);
-		buf_add(&byte, 1, buf, buf_pos);
-		buf_add(&repeat, 1, buf, buf_pos);
-		buf_add(&byte, 1, buf, buf_pos);
-		out_len += 4;
-		count -= 4096;
-	}
-	if (count / 64 > 0) {
-		repeat = 0xc0 + count / 64;
-		buf_add(&repeat, 1, buf, buf_pos);
-		buf_add(&byte, 1, buf, buf_pos);
-		out_len += 2;
-		count -= count / 64 * 64;
-	}
-	if (count > 0) {
-		repeat = 0x80 + count;
-		buf_add(&repeat, 1, buf, buf_pos);
-		buf_add(&byte, 1, buf, buf_pos);
-		out_len += 2;
-	}
-
-	return out_len;
-}
-
-u32 encode_line(u8 *data, int len, u8 *buf, int *buf_pos, bool *empty) {
-	u8 last = data[0];
-	int raw_pos = 0, run_len = 0;
-	u8 empty_table = 0x80;
-	u32 out_len = 0;
-
-	*empty = true;
-
-	buf_add(&empty_table, 1, buf, buf_pos);
-	out_len += 1;
-
-	for (int i = 0; i < len; i++) {
-		if (*empty && data[i] != 0x00)
-			*empty = false;
-//		DBG("i=%d ", i);
-		if (data[i] == last) {
-//			DBG("run_len++");
-			run_len++;
-		} else {
-			if (run_len > 2) {
-				out_len += encode_raw(data + raw_pos, i - raw_pos - run_len, buf, buf_pos);
-				out_len += encode_rle(last, run_len, buf, buf_pos);
-				raw_pos = i;
-			}
-//			DBG("run_len = 0");
-			run_len = 1;
-		}
-		last = data[i];
-//		DBG("\n");
-	}
-//	DBG("flush\n");
-	if (run_len < 3)
-		run_len = 0;
-	out_len += encode_raw(data + raw_pos, len - raw_pos - run_len, buf, buf_pos);
-	out_len += encode_rle(last, run_len, buf, buf_pos);
-
-	/* padding for 2500W */
-	if (model == M2500W) {
-		char pad_header[2];
-		/* compute padding length for the row length to be multiple of 4 */
-		char padlen = (4 - ((out_len + sizeof(pad_header)) % 4)) % 4;
-		char padding[] = { 0xff, 0xff, 0xff };
-		int rowlen = out_len + sizeof(pad_header) + padlen;
-
-		pad_header[0] = (padlen << 6) | ((rowlen >> 8) & 0x3f);
-		pad_header[1] = rowlen & 0xff;
-		/* make space for pad_header and padding */
-		memmove(buf + *buf_pos - out_len + 1 + sizeof(pad_header) + padlen, buf + *buf_pos - out_len + 1, out_len);
-		/* insert pad_header and padding */
-		memcpy(buf + *buf_pos - out_len + 1, pad_header, sizeof(pad_header));
-		memcpy(buf + *buf_pos - out_len + 1 + sizeof(pad_header), padding, padlen);
-		buf[*buf_pos - out_len] |= 0x40;
-		*buf_pos += sizeof(pad_header) + padlen;
-		out_len += sizeof(pad_header) + padlen;
-	}
-
-	return out_len;
-}
-
-void write_data_block(FILE *stream, enum m2x00w_color color, u8 *buf, int buf_pos, u32 len, u8 block_num, u16 lines) {
-	struct block_data header = {
-		.data_len = cpu_to_le32(len),
-		.color = color,
-		.block_num = block_num,
-		.lines = cpu_to_le16(lines),
-	};
-	write_block(M2X00W_BLOCK_DATA, &header, sizeof(header), stream);
-	fwrite(buf + buf_pos - len, 1, len, stream);
-//	DBG("wrote %d byte block, buf_pos=%d\n", len, buf_pos);
-}
-
-/* a wrapper to simplify lazy-color mode */
-unsigned cups_get_pixels(cups_raster_t *r, unsigned char *p, unsigned len) {
-	if (r)
-		return cupsRasterReadPixels(r, p, len);
-	else {	/* all zero data */
-		memset(p, 0, len);
-		return len;
-	}
-}
-
-void encode_color(cups_raster_t *ras, FILE *stream, int height, int line_len_file, u16 lines_per_block, enum m2x00w_color color) {
-	int line = 0, block_len = 0, buf_pos = 0;
-	u8 data[2 * line_len_file];
-	u8 data_block_seq = 1;
-	bool empty;
-	u8 *buf = malloc(buf_size);
-
-	if (!buf) {
-		ERR("Memory allocation error");
-		exit(1);
-	}
-	DBG("encode_color ras=%p, height=%d, color=%d", ras, height, color);
-	while (line < height && cups_get_pixels(ras, data, line_len_file)) {
-		if (model == M2400W) { /* interleaved lines */
-			u8 data2[line_len_file];
-			if (line >= height || !cups_get_pixels(ras, data2, line_len_file))
-				memset(data2, 0, line_len_file);
-			for (int i = line_len_file - 1; i >= 0; i--) {
-				data[2 * i] = data[i];
-				data[2 * i + 1] = data2[i];
-			}
-			block_len += encode_line(data, 2 * line_len_file, buf, &buf_pos, &empty);
-			line += 2;
-		} else {
-			block_len += encode_line(data, line_len_file, buf, &buf_pos, &empty);
-			line++;
-		}
-		/*
-		 * Lazy color mode:
-		 * We don't output any data as long as zero color bytes are coming from CUPS.
-		 * So if all YMC color bytes are zero, the page is printed in BW mode, increasing print speed.
-		 * This means that when we found the first non-zero byte in any of YMC colors, we need to output
-		 * everything that we omitted before (in the hope that it won't be needed):
-		 *  - all previous empty colors (Y and M when we're in C, only Y when in M and nothing in Y)
-		 *  - empty blocks of the current color
-		 * This method might seem a bit strange but it saves us from buffering large amounts of data.
-		 */
-		if (page_params.color_mode != MODE_COLOR && color != COLOR_K && !empty) {
-			DBG("Found first color byte in lazy color mode before line %d", line);
-			/* we found first non-zero color byte: set mode to color and output the page params */
-			page_params.color_mode = MODE_COLOR;
-			page_params.blocks1 = page_params.blocks2 = cpu_to_le16(BLOCKS_PER_PAGE * 4);
-			write_block(M2X00W_BLOCK_PAGE, &page_params, sizeof(page_params), stdout);
-			/* now we have to output the empty color data we omitted before */
-			if (color == COLOR_C || color == COLOR_M)	/* output empty Y */
-				encode_color(NULL, stdout, height, line_len_file, lines_per_block, COLOR_Y);
-			if (color == COLOR_C)	/* output empty M */
-				encode_color(NULL, stdout, height, line_len_file, lines_per_block, COLOR_M);
-			/* output empty blocks of the current color that we omitted before */
-			if (line > lines_per_block)
-				encode_color(NULL, stdout, line / lines_per_block * lines_per_block, line_len_file, lines_per_block, color);
-		}
-		if (line % lines_per_block == 0) {
-			/* output data only if encoding black or we have found a non-empty color byte */
-			if (color == COLOR_K || page_params.color_mode == MODE_COLOR)
-				write_data_block(stream, color, buf, buf_pos, block_len, data_block_seq, lines_per_block);
-			data_block_seq++;
-			block_len = 0;
-		}
-	}
-	if (line % lines_per_block)
-		/* output data only if encoding black or we have found a non-empty color byte */
-		if (color == COLOR_K || page_params.color_mode == MODE_COLOR)
-			write_data_block(stream, color, buf, buf_pos, block_len, data_block_seq, line % lines_per_block);
-	free(buf);
+/* PostScript points to millimeters */
+int pt_to_mm(unsigned int pt) {
+	return (pt * 254 + 360) / 720;
 }
 
 char *ppd_get(ppd_file_t *ppd, const char *name) {
@@ -303,120 +53,351 @@ char *ppd_get(ppd_file_t *ppd, const char *name) {
 	}
 }
 
-int main(int argc, char *argv[]) {
-	cups_raster_t *ras = NULL;
-	cups_page_header2_t page_header;
-	unsigned int page = 0, copies;
-	int fd;
+/* state shared by all jobs processed by one filter process */
+struct filter {
 	ppd_file_t *ppd;
-	bool header_written = false;
+	struct m2x00w_encoder *enc;
+	unsigned int copies;
+	int bands;
+	u8 *line;
+	int line_size;
+	/* ink coverage accounting */
+	bool count_dots;
+	bool estimate;		/* report predicted size instead of printing */
+	FILE *accounting;	/* JSON records, one line per page */
+	const char *job;
+	const char *user;
+	/* output capture for debugging */
+	const char *capture_dir;
+	u64 capture_max;
+};
+
+bool option_true(const char *value) {
+	return value && (!strcasecmp(value, "true") || !strcasecmp(value, "yes") || !strcasecmp(value, "on"));
+}
 
-	if (argc < 6 || argc > 7) {
-		fprintf(stderr, "usage: rastertom2x00w job-id user title copies options [file]\n");
-		return 1;
-	}
+/* report dots printed on a page as CUPS attributes and accounting record */
+void report_coverage(struct filter *flt, unsigned int page, const struct m2x00w_page_stats *stats) {
+	static const char *plane[] = { [COLOR_K] = "k", [COLOR_C] = "c", [COLOR_M] = "m", [COLOR_Y] = "y" };
+
+	fprintf(stderr, "ATTR: m2x00w-page=%u m2x00w-pixels=%llu", page, (unsigned long long)stats->pixels);
+	for (int i = 0; i < 4; i++)
+		fprintf(stderr, " m2x00w-dots-%s=%llu", plane[i], (unsigned long long)stats->dots[i]);
+	fprintf(stderr, "\n");
+
+	if (!flt->accounting)
+		return;
+	fprintf(flt->accounting, "{\"job\":");
+	m2x00w_json_string(flt->accounting, flt->job);
+	fprintf(flt->accounting, ",\"user\":");
+	m2x00w_json_string(flt->accounting, flt->user);
+	fprintf(flt->accounting, ",\"time\":%ld,\"page\":%u,\"pixels\":%llu,\"dots\":{",
+		(long)time(NULL), page, (unsigned long long)stats->pixels);
+	for (int i = 0; i < 4; i++)
+		fprintf(flt->accounting, "%s\"%s\":%llu", i ? "," : "", plane[i], (unsigned long long)stats->dots[i]);
+	fprintf(flt->accounting, "},\"coverage\":{");
+	for (int i = 0; i < 4; i++)
+		fprintf(flt->accounting, "%s\"%s\":%.4f", i ? "," : "", plane[i],
+			stats->pixels ? 100.0 * stats->dots[i] / stats->pixels : 0.0);
+	fprintf(flt->accounting, "}}\n");
+	fflush(flt->accounting);
+}
+
+/* report printer data size of a page, predicted in estimate mode */
+void report_size(struct filter *flt, unsigned int page, const struct m2x00w_page_stats *stats) {
+	if (flt->estimate)
+		fprintf(stderr, "ATTR: m2x00w-page=%u m2x00w-page-bytes=%llu m2x00w-max-band=%u\n",
+			page, (unsigned long long)stats->bytes, stats->max_band);
+	DBG("page %u: %llu bytes, %llu raster bytes (%.1f%%), largest band %u bytes", page,
+		(unsigned long long)stats->bytes, (unsigned long long)stats->raster_bytes,
+		stats->raster_bytes ? 100.0 * stats->bytes / stats->raster_bytes : 0.0, stats->max_band);
+}
+
+int filter_init(struct filter *flt, const char *copies, const char *options_str) {
+	enum m2x00w_model model;
 	int n;
 	cups_option_t *options;
 
-	copies = atoi(argv[4]);
-	if (copies < 1)
-		copies = 1;
+	flt->copies = atoi(copies);
+	if (flt->copies < 1)
+		flt->copies = 1;
 
-	if (argc > 6) {
-		fd = open(argv[6], O_RDONLY);
-		if (fd == -1) {
-			perror("ERROR: Unable to open raster file - ");
-			return 1;
-		}
-	} else
-		fd = 0;
-	ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
-	ppd = ppdOpenFile(getenv("PPD"));
-	if (!ppd) {
+	flt->ppd = ppdOpenFile(getenv("PPD"));
+	if (!flt->ppd) {
 		fprintf(stderr, "Unable to open PPD file %s\n", getenv("PPD"));
 		return 2;
 	}
-	ppdMarkDefaults(ppd);
-	n = cupsParseOptions(argv[5], 0, &options);
-	cupsMarkOptions(ppd, n, options);
+	ppdMarkDefaults(flt->ppd);
+	n = cupsParseOptions(options_str, 0, &options);
+	cupsMarkOptions(flt->ppd, n, options);
+	flt->count_dots = option_true(cupsGetOption("ink-accounting", n, options));
+	flt->estimate = option_true(cupsGetOption("m2x00w-estimate", n, options));
 	cupsFreeOptions(n, options);
 
-	model = atoi(ppd_get(ppd, "cupsModelNumber"));
-	DBG("model=0x%02x", model);
-	if (model != M2300W && model != M2400W && model != M2500W) {
+	/* M2X00W_ACCOUNTING=file appends a JSON accounting record for each page */
+	const char *accounting = getenv("M2X00W_ACCOUNTING");
+	if (accounting && *accounting) {
+		flt->accounting = fopen(accounting, "a");
+		if (!flt->accounting)
+			WARN("Unable to open accounting file %s", accounting);
+		flt->count_dots = true;
+	}
+
+	/* M2X00W_CAPTURE_DIR=dir keeps copies of recent jobs (up to M2X00W_CAPTURE_MAX MB) */
+	flt->capture_dir = getenv("M2X00W_CAPTURE_DIR");
+	if (flt->capture_dir && !*flt->capture_dir)
+		flt->capture_dir = NULL;
+	const char *capture_max = getenv("M2X00W_CAPTURE_MAX");
+	flt->capture_max = (capture_max ? strtoull(capture_max, NULL, 10) : 64) * 1024 * 1024;
+
+	model = atoi(ppd_get(flt->ppd, "cupsModelNumber"));
+	const char *bands = ppd_get(flt->ppd, "m2x00wBands");
+	flt->bands = bands ? atoi(bands) : BLOCKS_PER_PAGE;
+	DBG("model=0x%02x bands=%d", model, flt->bands);
+	flt->enc = m2x00w_encoder_new(model, m2x00w_stdio_sink, stdout);
+	if (!flt->enc) {
 		ERR("Invalid model number 0x%02x\n", model);
 		return 3;
 	}
+	m2x00w_encoder_count_dots(flt->enc, flt->count_dots);
+	m2x00w_encoder_estimate(flt->enc, flt->estimate);
+
+	return 0;
+}
 
-	/* document beginning */
-	struct block_begin begin = { .model = model, .color = 0x10 };
-	write_block(M2X00W_BLOCK_BEGIN, &begin, sizeof(begin), stdout);
+void filter_free(struct filter *flt) {
+	m2x00w_encoder_free(flt->enc);
+	ppdClose(flt->ppd);
+	free(flt->line);
+	if (flt->accounting)
+		fclose(flt->accounting);
+}
+
+/* encode one raster stream into a complete printer job written to stream */
+int print_job(struct filter *flt, int fd, FILE *stream) {
+	struct m2x00w_encoder *enc = flt->enc;
+	cups_raster_t *ras;
+	cups_page_header2_t page_header;
+	unsigned int page = 0;
+	struct m2x00w_capture *capture = NULL;
+	int ret = 1;
+
+	/* nothing to capture in estimate mode */
+	if (flt->capture_dir && !flt->estimate) {
+		capture = m2x00w_capture_start(flt->capture_dir, flt->job, flt->capture_max, m2x00w_stdio_sink, stream);
+		if (!capture)
+			WARN("Unable to capture output to %s", flt->capture_dir);
+	}
+	if (capture)
+		m2x00w_encoder_set_sink(enc, m2x00w_capture_sink, capture);
+	else
+		m2x00w_encoder_set_sink(enc, m2x00w_stdio_sink, stream);
+	ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+	if (m2x00w_encoder_begin_job(enc))
+		goto err;
 
 	while (cupsRasterReadHeader2(ras, &page_header)) {
 		page++;
 		fprintf(stderr, "PAGE: %d %d\n", page, page_header.NumCopies);
 
-		line_len_file = page_header.cupsBytesPerLine;
-		height = page_header.cupsHeight;
-		width = ROUND_UP_MULTIPLE(page_header.cupsWidth, 8);
-		u16 lines_per_block = DIV_ROUND_UP(height, BLOCKS_PER_PAGE);
-		/* worst case: start byte + 16-byte table + 5-byte padding + each byte encoded as two */
-		buf_size = 1 + 16 + 5 + 2 * line_len_file * lines_per_block;
-		dpi = page_header.HWResolution[0];
-		DBG("line_len_file=%d, height=%d width=%d, buf_size=%d", line_len_file, height, width, buf_size);
+		int line_len = page_header.cupsBytesPerLine;
+		int height = page_header.cupsHeight;
+		int dpi = page_header.HWResolution[0];
+		DBG("line_len_file=%d, height=%d width=%d", line_len, height, page_header.cupsWidth);
 		DBG("dpi_x=%d,cupsColorOrder=%d,cupsColorSpace=%d", dpi, page_header.cupsColorOrder, page_header.cupsColorSpace);
-		if (!header_written) {	/* print parameters */
-			struct block_params params = { .res_y = (model == M2300W) ? RES_1200DPI : RES_600DPI };
-			if (dpi == 600)
-				params.res_x = RES_MULT1;
-			else if (dpi == 1200)
-				params.res_x = RES_MULT2;
-			else if (dpi == 2400)
-				params.res_x = RES_MULT4;
-			write_block(M2X00W_BLOCK_PARAMS, &params, sizeof(params), stdout);
-			header_written = true;
-		}
 		char *page_size_name = page_header.cupsPageSizeName;
 		/* get page size name from PPD if cupsPageSizeName is empty */
 		if (strlen(page_size_name) == 0)
-			page_size_name = ppd_get(ppd, "PageSize");
-
-		page_params = (struct block_page) {
-			.color_mode = (model == M2300W) ? MODE_BW_2300 : MODE_BW,
-			.copies = (model == M2500W) ? copies : 1,
-			.x_end = cpu_to_le16(width),
-			.y_end = cpu_to_le16((model == M2400W) ? ROUND_UP_MULTIPLE(height, 2) : height),
-			.blocks1 = cpu_to_le16(BLOCKS_PER_PAGE),
-			.blocks2 = cpu_to_le16(BLOCKS_PER_PAGE),
-			.paper_size = encode_paper_size(page_size_name),
-//			.custom_width = ,
-//			.custom_height = ,
-//			.duplex = ,
-			.paper_weight = page_header.cupsMediaType,
-			.unknown = (model == M2300W) ? 1 : 0,/////
-		};
+			page_size_name = ppd_get(flt->ppd, "PageSize");
 
 		if (page_header.cupsColorSpace != CUPS_CSPACE_K && page_header.cupsColorSpace != CUPS_CSPACE_YMCK) {
 			ERR("invalid color space: %d", page_header.cupsColorSpace);
-			return 3;
+			ret = 3;
+			goto out;
+		}
+		struct m2x00w_page_info info = {
+			.width = page_header.cupsWidth,
+			.height = height,
+			.line_len = line_len,
+			.dpi = dpi,
+			.color = (page_header.cupsColorSpace == CUPS_CSPACE_YMCK),
+			.copies = flt->copies,
+			.paper_size = m2x00w_paper_size(page_size_name),
+			.media_type = page_header.cupsMediaType,
+			.bands = flt->bands,
+		};
+		if (info.paper_size == PAPER_CUSTOM) {
+			info.custom_width = pt_to_mm(page_header.PageSize[0]);
+			info.custom_height = pt_to_mm(page_header.PageSize[1]);
+			DBG("custom page size %s: %d x %d mm", page_size_name, info.custom_width, info.custom_height);
 		}
-		/* process raster data */
-		if (page_header.cupsColorSpace == CUPS_CSPACE_YMCK) {
-			encode_color(ras, stdout, height, line_len_file, lines_per_block, COLOR_Y);
-			encode_color(ras, stdout, height, line_len_file, lines_per_block, COLOR_M);
-			encode_color(ras, stdout, height, line_len_file, lines_per_block, COLOR_C);
+		if (m2x00w_encoder_begin_page(enc, &info))
+			goto err;
+		if (flt->line_size < line_len) {
+			free(flt->line);
+			flt->line = malloc(line_len);
+			flt->line_size = flt->line ? line_len : 0;
+			if (!flt->line) {
+				ERR("Memory allocation error");
+				goto out;
+			}
+		}
+		/* process raster data: Y, M, C and K planes or only K */
+		for (int i = 0; i < (info.color ? 4 : 1) * height; i++) {
+			if (!cupsRasterReadPixels(ras, flt->line, line_len))
+				break;
+			if (m2x00w_encoder_push_lines(enc, flt->line, 1))
+				goto err;
 		}
-		if (page_params.color_mode != MODE_COLOR) /* in color mode, page params were already written */
-			write_block(M2X00W_BLOCK_PAGE, &page_params, sizeof(page_params), stdout);
-		encode_color(ras, stdout, height, line_len_file, lines_per_block, COLOR_K);
+		if (m2x00w_encoder_end_page(enc))
+			goto err;
+		report_size(flt, page, m2x00w_encoder_page_stats(enc));
+		if (flt->count_dots)
+			report_coverage(flt, page, m2x00w_encoder_page_stats(enc));
 	}
-	ppdClose(ppd);
+	if (m2x00w_encoder_end_job(enc))
+		goto err;
+	ret = 0;
+	goto out;
+err:
+	ERR("%s", m2x00w_encoder_error(enc));
+out:
 	cupsRasterClose(ras);
-	/* end of print data */
-	char zero = 0;
-	write_block(M2X00W_BLOCK_ENDPART, &zero, 1, stdout);
-	/* end of document */
-	write_block(M2X00W_BLOCK_END, &zero, 1, stdout);
+	m2x00w_capture_finish(capture);
+	return ret;
+}
 
-	return 0;
+/* output file name for batch mode: job.ras -> job.prn */
+char *prn_name(const char *ras_name) {
+	const char *ext = strrchr(ras_name, '.');
+	int len = (ext && !strchr(ext, '/')) ? ext - ras_name : (int)strlen(ras_name);
+	char *name = malloc(len + 5);
+
+	if (name)
+		sprintf(name, "%.*s.prn", len, ras_name);
+
+	return name;
+}
+
+/* check if both names refer to one existing file (opening the output would truncate the input) */
+bool same_file(const char *a, const char *b) {
+	struct stat st_a, st_b;
+
+	if (stat(a, &st_a) || stat(b, &st_b))
+		return false;
+
+	return st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+/*
+ * Batch mode: encode many raster files with one parsed PPD and one encoder.
+ * Each job goes to its own .prn file next to the raster file, or with -o all jobs are
+ * written to one stream (each with its own BEGIN...END framing). "-" reads stdin.
+ */
+int batch(int argc, char *argv[]) {
+	struct filter flt = { 0 };
+	FILE *out = NULL;
+	int i = 4, ret, failed = 0;
+
+	if (argc < 5 || (!strcmp(argv[i], "-o") && argc < 7)) {
+		fprintf(stderr, "usage: rastertom2x00w --batch copies options [-o output] file...\n");
+		return 1;
+	}
+	if (!strcmp(argv[i], "-o")) {
+		for (int j = i + 2; j < argc; j++)
+			if (same_file(argv[i + 1], argv[j])) {
+				ERR("Output file %s is also an input file", argv[i + 1]);
+				return 1;
+			}
+		out = !strcmp(argv[i + 1], "-") ? stdout : fopen(argv[i + 1], "w");
+		if (!out) {
+			perror("ERROR: Unable to open output file - ");
+			return 1;
+		}
+		i += 2;
+	}
+	flt.user = getenv("USER");
+	ret = filter_init(&flt, argv[2], argv[3]);
+	if (ret)
+		return ret;
+
+	for (; i < argc; i++) {
+		bool use_stdin = !strcmp(argv[i], "-");
+		int fd = use_stdin ? 0 : open(argv[i], O_RDONLY);
+		FILE *stream = out;
+		char *name = NULL;
+
+		fprintf(stderr, "INFO: M2X00W job %s\n", argv[i]);
+		flt.job = argv[i];
+		if (fd == -1) {
+			ERR("Unable to open raster file %s", argv[i]);
+			failed++;
+			continue;
+		}
+		if (!stream) {
+			name = use_stdin ? NULL : prn_name(argv[i]);
+			if (name && same_file(name, argv[i])) {
+				ERR("Output file %s would overwrite the raster file", name);
+				free(name);
+				close(fd);
+				failed++;
+				continue;
+			}
+			stream = name ? fopen(name, "w") : stdout;
+			if (!stream) {
+				ERR("Unable to create output file %s", name);
+				free(name);
+				close(fd);
+				failed++;
+				continue;
+			}
+		}
+		if (print_job(&flt, fd, stream))
+			failed++;
+		if (fflush(stream)) {
+			ERR("Write error");
+			failed++;
+		}
+		if (stream != out && stream != stdout)
+			fclose(stream);
+		free(name);
+		if (!use_stdin)
+			close(fd);
+	}
+	if (out && out != stdout)
+		fclose(out);
+	filter_free(&flt);
+
+	return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+	struct filter flt = { 0 };
+	int fd, ret;
+
+	if (argc > 1 && !strcmp(argv[1], "--batch"))
+		return batch(argc, argv);
+
+	if (argc < 6 || argc > 7) {
+		fprintf(stderr, "usage: rastertom2x00w job-id user title copies options [file]\n");
+		fprintf(stderr, "       rastertom2x00w --batch copies options [-o output] file...\n");
+		return 1;
+	}
+
+	if (argc > 6) {
+		fd = open(argv[6], O_RDONLY);
+		if (fd == -1) {
+			perror("ERROR: Unable to open raster file - ");
+			return 1;
+		}
+	} else
+		fd = 0;
+	flt.job = argv[1];
+	flt.user = argv[2];
+	ret = filter_init(&flt, argv[4], argv[5]);
+	if (!ret)
+		ret = print_job(&flt, fd, stdout);
+	filter_free(&flt);
+
+	return ret;
 }